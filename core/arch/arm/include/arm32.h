@@ -117,6 +117,11 @@
 #define DACR_DOMAIN_PERM_CLIENT		0x1
 #define DACR_DOMAIN_PERM_MANAGER	0x3
 
+#define PMCR_E			BIT32(0)
+#define PMCR_C			BIT32(2)
+#define PMCR_DP			BIT32(5)
+#define PMCNTEN_CCNT		BIT32(31)
+
 #define PAR_F			BIT32(0)
 #define PAR_SS			BIT32(1)
 #define PAR_LPAE		BIT32(11)
@@ -334,6 +339,13 @@ static inline uint32_t read_dfar(void)
 	return dfar;
 }
 
+static inline void write_dfar(uint32_t dfar)
+{
+	asm volatile ("mcr	p15, 0, %[dfar], c6, c0, 0"
+			: : [dfar] "r" (dfar)
+	);
+}
+
 static inline uint32_t read_dfsr(void)
 {
 	uint32_t dfsr;
@@ -356,6 +368,35 @@ static inline uint32_t read_ifsr(void)
 	return ifsr;
 }
 
+static inline void write_dfsr(uint32_t dfsr)
+{
+	asm volatile ("mcr	p15, 0, %[dfsr], c5, c0, 0"
+			: : [dfsr] "r" (dfsr)
+	);
+}
+
+static inline uint32_t read_vbar(void)
+{
+	uint32_t vbar;
+
+	asm volatile ("mrc	p15, 0, %[vbar], c12, c0, 0"
+			: [vbar] "=r" (vbar)
+	);
+
+	return vbar;
+}
+
+static inline uint32_t read_scr(void)
+{
+	uint32_t scr;
+
+	asm volatile ("mrc	p15, 0, %[scr], c1, c1, 0"
+			: [scr] "=r" (scr)
+	);
+
+	return scr;
+}
+
 static inline void write_scr(uint32_t scr)
 {
 	asm volatile ("mcr	p15, 0, %[scr], c1, c1, 0"
@@ -409,6 +450,12 @@ static inline void write_ats1cpur(uint32_t va)
 	asm volatile ("mcr	p15, 0, %0, c7, c8, 2" : : "r" (va));
 }
 
+/* Address translate stages 1 and 2 non-secure PL1 read (other state) */
+static inline void write_ats12nsopr(uint32_t va)
+{
+	asm volatile ("mcr	p15, 0, %0, c7, c8, 4" : : "r" (va));
+}
+
 static inline uint32_t read_par32(void)
 {
 	uint32_t val;
@@ -646,6 +693,24 @@ static inline uint64_t read_pmu_ccnt(void)
 	asm volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(val));
 	return val;
 }
+
+static inline uint32_t read_pmcr(void)
+{
+	uint32_t val;
+
+	asm volatile("mrc p15, 0, %0, c9, c12, 0" : "=r"(val));
+	return val;
+}
+
+static inline void write_pmcr(uint32_t val)
+{
+	asm volatile("mcr p15, 0, %0, c9, c12, 0" : : "r"(val));
+}
+
+static inline void write_pmcntenset(uint32_t val)
+{
+	asm volatile("mcr p15, 0, %0, c9, c12, 1" : : "r"(val));
+}
 #endif /*ASM*/
 
 #endif /*ARM32_H*/
@@ -359,6 +359,7 @@ bool core_mmu_mattr_is_ok(uint32_t mattr);
 
 const struct tee_mmap_region *core_mmu_find_map_by_type(enum teecore_memtypes type);
 const struct tee_mmap_region *core_mmu_find_map_by_type_and_pa(enum teecore_memtypes type, paddr_t pa);
+const struct tee_mmap_region *core_mmu_find_next_map_by_type(enum teecore_memtypes type, const struct tee_mmap_region *prev);
 
 void core_mmu_get_mem_by_type(enum teecore_memtypes type, vaddr_t *s,
 			      vaddr_t *e);
@@ -374,6 +375,12 @@ static inline bool core_mmu_is_shm_cached(void)
 
 bool core_mmu_add_mapping(enum teecore_memtypes type, paddr_t addr, size_t len);
 
+/*
+ * Called by core_mmu_add_mapping() once a MEM_AREA_IO_SEC region has been
+ * mapped. The default does nothing.
+ */
+void core_mmu_io_sec_mapped(paddr_t pa, vaddr_t va, size_t size);
+
 /* various invalidate secure TLB */
 enum teecore_tlb_op {
 	TLBINV_UNIFIEDTLB,	/* invalidate unified tlb */
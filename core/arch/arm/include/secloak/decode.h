@@ -0,0 +1,96 @@
+#ifndef SECLOAK_DECODE_H
+#define SECLOAK_DECODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum emu_op {
+	EMU_OP_LOAD,
+	EMU_OP_STORE,
+	EMU_OP_LOAD_DUAL,
+	EMU_OP_STORE_DUAL,
+	EMU_OP_LOAD_MULTIPLE,
+	EMU_OP_STORE_MULTIPLE,
+	EMU_OP_DATA,
+	EMU_OP_BARRIER,
+	EMU_OP_NOP,
+	EMU_OP_UNSUPPORTED,
+};
+
+enum emu_shift {
+	EMU_SHIFT_LSL,
+	EMU_SHIFT_LSR,
+	EMU_SHIFT_ASR,
+	EMU_SHIFT_ROR,
+};
+
+// Data-processing operations, numbered as in the ARM encoding
+enum emu_alu {
+	EMU_ALU_AND,
+	EMU_ALU_EOR,
+	EMU_ALU_SUB,
+	EMU_ALU_RSB,
+	EMU_ALU_ADD,
+	EMU_ALU_ADC,
+	EMU_ALU_SBC,
+	EMU_ALU_RSC,
+	EMU_ALU_TST,
+	EMU_ALU_TEQ,
+	EMU_ALU_CMP,
+	EMU_ALU_CMN,
+	EMU_ALU_ORR,
+	EMU_ALU_MOV,
+	EMU_ALU_BIC,
+	EMU_ALU_MVN,
+	EMU_ALU_ORN,
+	EMU_ALU_MOVT,
+};
+
+#define EMU_COND_AL 0xE
+
+/*
+ * Decoded instruction. For single and dual transfers, the address is computed
+ * from Rn and either the immediate or the shifted Rm, using the add/index/wback
+ * flags (U, P and W in the ARM encodings). For multiple transfers, add and
+ * index select between the IA/IB/DA/DB addressing modes.
+ *
+ * Data-processing instructions compute Rd from Rn and a second operand, which
+ * is either the (already expanded) immediate or Rm shifted by an immediate or
+ * by Rs. Shift amounts are kept as encoded, so an immediate LSR/ASR of 0 means
+ * 32 and an immediate ROR of 0 means RRX. When imm_carry is set, the shifter
+ * carry out of the immediate is its top bit.
+ */
+struct emu_instr {
+	uint8_t op;
+	uint8_t length;
+	uint8_t cond;
+	uint8_t size;
+	bool sign;
+	uint8_t rt;
+	uint8_t rt2;
+	uint8_t rn;
+	uint8_t rm;
+	bool reg_offset;
+	uint8_t shift_type;
+	uint8_t shift_amount;
+	bool add;
+	bool index;
+	bool wback;
+	uint16_t reglist;
+	uint32_t imm;
+	uint8_t alu;
+	uint8_t rd;
+	uint8_t rs;
+	bool reg_shift;
+	bool setflags;
+	bool imm_carry;
+};
+
+static inline bool emu_thumb_is_32bit(uint16_t hw1) {
+	return ((hw1 >> 11) >= 0x1D);
+}
+
+bool emu_decode_arm(uint32_t instr, struct emu_instr *d);
+bool emu_decode_thumb(uint16_t hw1, uint16_t hw2, struct emu_instr *d);
+
+#endif
@@ -1,9 +1,11 @@
 #ifndef SECLOAK_EMULATION_H
 #define SECLOAK_EMULATION_H
 
+#include <compiler.h>
 #include <io.h>
 #include <sm/sm.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/queue.h>
 
@@ -16,18 +18,222 @@ enum emu_state {
 struct region;
 typedef bool (*emu_check_t)(struct region *, paddr_t, enum emu_state, uint32_t*);
 
+#define EMU_POLICY_DENY_READ     (1 << 0)
+#define EMU_POLICY_DENY_WRITE    (1 << 1)
+#define EMU_POLICY_MATCH_CURRENT (1 << 2)
+#define EMU_POLICY_SHADOW        (1 << 3)
+#define EMU_POLICY_VIRTUAL       (1 << 4)
+#define EMU_POLICY_POLLABLE      (1 << 5)
+
+/*
+ * Policy for a single register, at an offset from the base of the region.
+ *
+ * Reads return the bits of the register in read_mask, ORed with read_value.
+ * Writes are denied if the bits in match_mask differ from match_value (or from
+ * the current register value, with EMU_POLICY_MATCH_CURRENT). Bits outside of
+ * write_mask keep their current value. If set, the hook is called afterwards
+ * for anything the table alone cannot express.
+ *
+ * With EMU_POLICY_SHADOW, the register only changes when it is written, so
+ * word reads are served from a copy in secure memory once it has been read or
+ * written through the emulator. Secure code writing such a register directly
+ * must call emu_shadow_invalidate afterwards, which also drops the value of
+ * any read of the register still in flight on another core.
+ *
+ * With EMU_POLICY_VIRTUAL, the register does not exist in the device, and
+ * accesses never reach it: reads start out as 0 and writes are only seen by
+ * the hook, which implements the register.
+ *
+ * With EMU_POLICY_POLLABLE, reading the register has no side effects, so the
+ * emulator may read it again on its own while the NS world spins on it. Only
+ * status registers should be marked, never FIFOs or clear-on-read registers.
+ *
+ * The masks and values may be updated while the policy is in use, as each of
+ * them is only read once per access.
+ */
+struct emu_reg_policy {
+	uint32_t offset;
+	uint32_t flags;
+	uint32_t read_mask;
+	uint32_t read_value;
+	uint32_t write_mask;
+	uint32_t match_mask;
+	uint32_t match_value;
+	emu_check_t hook;
+	uint32_t shadow;
+	uint32_t shadow_seq;
+	bool shadow_valid;
+};
+
+/*
+ * Registers of the region without an entry are allowed. With posted set, NS
+ * stores to them are queued during a trap and issued in order once the trap
+ * is done emulating (or earlier, before any other emulated access, at a
+ * barrier or when the queue is full), so this is only for devices that do not
+ * care when a write lands relative to the NS code that follows it.
+ */
+struct emu_policy {
+	int num_regs;
+	struct emu_reg_policy *regs;
+	bool posted;
+};
+
 struct region {
 	paddr_t base;
 	uint32_t size;
 	emu_check_t check;
+	struct emu_policy *policy;
+	vaddr_t vbase;
+	uint32_t storms;
+	uint32_t storm_aborts;
 	SLIST_ENTRY(region) entry;
 };
 
+void emu_add_data_window(paddr_t pa, vaddr_t va, size_t size);
+
 int32_t emu_add_region(paddr_t base, uint32_t size, emu_check_t check);
 void emu_remove_region(paddr_t base, uint32_t size, emu_check_t check);
 
+void emu_shadow_invalidate(struct emu_reg_policy *reg);
+
+int32_t emu_add_policy_region(paddr_t base, uint32_t size, struct emu_policy *policy);
+void emu_remove_policy_region(paddr_t base, uint32_t size, struct emu_policy *policy);
+
+// A region to add or remove through emu_update_regions (policy is only set for emu_policy_check)
+struct emu_region_update {
+	paddr_t base;
+	uint32_t size;
+	emu_check_t check;
+	struct emu_policy *policy;
+	bool add;
+};
+
+int32_t emu_update_regions(const struct emu_region_update *updates, int num_updates);
+
 bool emu_allow_all(struct region *region, paddr_t address, enum emu_state state, uint32_t *value);
 bool emu_deny_all(struct region *region, paddr_t address, enum emu_state state, uint32_t *value);
+bool emu_policy_check(struct region *region, paddr_t address, enum emu_state state, uint32_t *value);
+
+// Whether a region allowing all accesses covers the range, and every other region overlapping it does too
+bool emu_range_allows_all(paddr_t base, size_t size);
+
+void emu_get_decode_stats(uint32_t *hits, uint32_t *misses);
+
+#ifdef CFG_SECLOAK_EMU_ITLB
+// Returned by emu_itlb_translate when the NS instruction address cannot be translated (never halfword aligned)
+#define EMU_ITLB_INVALID ((paddr_t)-1)
+
+paddr_t emu_itlb_translate(uint32_t va, uint32_t ttbr0, uint32_t ttbr1, uint32_t contextidr);
+void emu_get_itlb_stats(uint32_t *hits, uint32_t *misses, uint32_t *flushes);
+#endif
+
+// Trap statistics for a single register, summed over all cores
+struct emu_stats_entry {
+	uint32_t region_base;
+	uint32_t paddr;
+	uint32_t traps;
+	uint32_t accesses;
+	uint32_t denied;
+	uint32_t reserved;
+	uint64_t cycles;
+};
+
+struct emu_stats_header {
+	uint32_t num_entries;
+	uint32_t dropped;
+	struct emu_stats_entry entries[];
+};
+
+#ifdef CFG_SECLOAK_EMU_STATS
+size_t emu_stats_dump(struct emu_stats_header *header, size_t max_entries, bool reset);
+uint32_t emu_stats_traps(paddr_t base, size_t size);
+#else
+static inline size_t emu_stats_dump(struct emu_stats_header *header, size_t max_entries __unused, bool reset __unused) {
+	header->num_entries = 0;
+	header->dropped = 0;
+	return 0;
+}
+
+static inline uint32_t emu_stats_traps(paddr_t base __unused, size_t size __unused) {
+	return 0;
+}
+#endif
+
+#define EMU_TRACE_WRITE   (1 << 0)
+#define EMU_TRACE_ALLOWED (1 << 1)
+
+// A single emulated access, with the value before and after the policy was applied
+struct emu_trace_record {
+	uint32_t timestamp;
+	uint16_t core;
+	uint8_t size;
+	uint8_t flags;
+	uint32_t instr_paddr;
+	uint32_t data_paddr;
+	uint32_t value_before;
+	uint32_t value_after;
+};
+
+/*
+ * Ring of trace records in NS shared memory. The secure world advances head
+ * after writing each record, and the NS world advances tail after reading.
+ * Both are free-running counts, so the next record is at head % capacity.
+ */
+struct emu_trace_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t capacity;
+	uint32_t dropped;
+	struct emu_trace_record records[];
+};
+
+#ifdef CFG_SECLOAK_EMU_TRACE
+void emu_trace_set(struct emu_trace_ring *ring, uint32_t capacity);
+#else
+static inline void emu_trace_set(struct emu_trace_ring *ring __unused, uint32_t capacity __unused) {
+}
+#endif
+
+// Trap storms seen on a deny-all region, and the aborts injected because of them
+struct emu_storm_entry {
+	uint32_t region_base;
+	uint32_t size;
+	uint32_t storms;
+	uint32_t aborts;
+};
+
+#if CFG_SECLOAK_EMU_STORM_TRAPS > 0
+size_t emu_storm_dump(struct emu_storm_entry *entries, size_t max_entries);
+#else
+static inline size_t emu_storm_dump(struct emu_storm_entry *entries __unused, size_t max_entries __unused) {
+	return 0;
+}
+#endif
+
+#define EMU_BATCH_READ   0
+#define EMU_BATCH_WRITE  1
+#define EMU_BATCH_MODIFY 2
+
+#define EMU_BATCH_OK      0
+#define EMU_BATCH_DENIED  1
+#define EMU_BATCH_INVALID 2
+
+/*
+ * A register access requested by the NS world through OPTEE_SMC_CLOAK_EMU_BATCH.
+ * Reads return the value, writes take it, and modifies replace the bits in mask
+ * with those of value and return the value written. Denied reads return 0.
+ */
+struct emu_batch_op {
+	uint32_t address;
+	uint8_t size;
+	uint8_t op;
+	uint8_t result;
+	uint8_t reserved;
+	uint32_t value;
+	uint32_t mask;
+};
+
+size_t emu_batch(struct emu_batch_op *ops, size_t num_ops);
 
 void emu_handle(struct sm_ctx *ctx, unsigned long status, unsigned long data_paddr, unsigned long instr_paddr);
 
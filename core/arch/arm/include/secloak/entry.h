@@ -33,6 +33,97 @@
 #define OPTEE_SMC_CLOAK_GET \
 	OPTEE_SMC_STD_CALL_VAL(OPTEE_SMC_FUNCID_CLOAK_GET)
 
+/*
+ * Dump the emulation trap statistics into non-secure shared memory, as a
+ * struct emu_stats_header followed by its entries
+ *
+ * Call register usage:
+ * a0 SMC Function ID, OPTEE_SMC_CLOAK_EMU_STATS
+ * a1 Physical address of the buffer
+ * a2 Size of the buffer
+ * a3 Non-zero to reset the statistics after dumping them
+ *
+ * Normal return register usage:
+ * a0 OPTEE_SMC_RETURN_OK
+ * a1 Number of entries written
+ * a2-7 Preserved
+ *
+ * Not accepted buffer return register usage:
+ * a0 OPTEE_SMC_RETURN_EBADADDR
+ */
+#define OPTEE_SMC_FUNCID_CLOAK_EMU_STATS	101
+#define OPTEE_SMC_CLOAK_EMU_STATS \
+	OPTEE_SMC_STD_CALL_VAL(OPTEE_SMC_FUNCID_CLOAK_EMU_STATS)
+
+/*
+ * Start (or stop) tracing every emulated access into a ring in non-secure
+ * shared memory, as a struct emu_trace_ring followed by its records. The ring
+ * is drained by reading records up to head and then advancing tail.
+ *
+ * Call register usage:
+ * a0 SMC Function ID, OPTEE_SMC_CLOAK_EMU_TRACE
+ * a1 Physical address of the ring
+ * a2 Size of the ring, or 0 to stop tracing
+ *
+ * Normal return register usage:
+ * a0 OPTEE_SMC_RETURN_OK
+ * a1 Number of records the ring can hold
+ * a2-7 Preserved
+ *
+ * Not accepted buffer return register usage:
+ * a0 OPTEE_SMC_RETURN_EBADADDR
+ */
+#define OPTEE_SMC_FUNCID_CLOAK_EMU_TRACE	102
+#define OPTEE_SMC_CLOAK_EMU_TRACE \
+	OPTEE_SMC_STD_CALL_VAL(OPTEE_SMC_FUNCID_CLOAK_EMU_TRACE)
+
+/*
+ * Perform a batch of accesses to emulated device registers, as an array of
+ * struct emu_batch_op in non-secure shared memory. Each access is checked
+ * against the same policies as a trapped access, and its value and result
+ * are written back in place.
+ *
+ * Call register usage:
+ * a0 SMC Function ID, OPTEE_SMC_CLOAK_EMU_BATCH
+ * a1 Physical address of the array
+ * a2 Number of accesses, at most OPTEE_SMC_CLOAK_EMU_BATCH_MAX
+ *
+ * Normal return register usage:
+ * a0 OPTEE_SMC_RETURN_OK
+ * a1 Number of accesses performed
+ * a2-7 Preserved
+ *
+ * Not accepted buffer return register usage:
+ * a0 OPTEE_SMC_RETURN_EBADADDR
+ */
+#define OPTEE_SMC_FUNCID_CLOAK_EMU_BATCH	103
+#define OPTEE_SMC_CLOAK_EMU_BATCH \
+	OPTEE_SMC_FAST_CALL_VAL(OPTEE_SMC_FUNCID_CLOAK_EMU_BATCH)
+#define OPTEE_SMC_CLOAK_EMU_BATCH_MAX	256
+
+/*
+ * Dump the trap storms seen on disabled devices into non-secure shared
+ * memory, as an array of struct emu_storm_entry (one per region that has had
+ * a storm). With CFG_SECLOAK_EMU_STORM_ABORT, accesses to the region raise
+ * external aborts while a storm lasts.
+ *
+ * Call register usage:
+ * a0 SMC Function ID, OPTEE_SMC_CLOAK_EMU_STORMS
+ * a1 Physical address of the buffer
+ * a2 Size of the buffer
+ *
+ * Normal return register usage:
+ * a0 OPTEE_SMC_RETURN_OK
+ * a1 Number of entries written
+ * a2-7 Preserved
+ *
+ * Not accepted buffer return register usage:
+ * a0 OPTEE_SMC_RETURN_EBADADDR
+ */
+#define OPTEE_SMC_FUNCID_CLOAK_EMU_STORMS	104
+#define OPTEE_SMC_CLOAK_EMU_STORMS \
+	OPTEE_SMC_STD_CALL_VAL(OPTEE_SMC_FUNCID_CLOAK_EMU_STORMS)
+
 struct thread_smc_args;
 void cloak_entry(struct thread_smc_args *args);
 
@@ -41,6 +41,7 @@ DEFINES
 	DEFINE(SM_NSEC_CTX_R0, offsetof(struct sm_nsec_ctx, r0));
 	DEFINE(SM_NSEC_CTX_R8, offsetof(struct sm_nsec_ctx, r8));
 	DEFINE(SM_NSEC_CTX_LR, offsetof(struct sm_nsec_ctx, lr));
+	DEFINE(SM_NSEC_CTX_MON_LR, offsetof(struct sm_nsec_ctx, mon_lr));
 	DEFINE(SM_SEC_CTX_R0, offsetof(struct sm_sec_ctx, r0));
 	DEFINE(SM_SEC_CTX_R8, offsetof(struct sm_sec_ctx, r8));
 	DEFINE(SM_SEC_CTX_MON_LR, offsetof(struct sm_sec_ctx, mon_lr));
@@ -157,6 +157,15 @@ const struct tee_mmap_region *core_mmu_find_map_by_type(enum teecore_memtypes ty
 	return find_map_by_type(type);
 }
 
+const struct tee_mmap_region *core_mmu_find_next_map_by_type(enum teecore_memtypes type, const struct tee_mmap_region *prev) {
+	const struct tee_mmap_region *map = prev ? (prev + 1) : static_memory_map;
+
+	for (; map->type != MEM_AREA_NOTYPE; map++)
+		if (map->type == type)
+			return map;
+	return NULL;
+}
+
 static struct tee_mmap_region *find_map_by_type_and_pa(
 			enum teecore_memtypes type, paddr_t pa)
 {
@@ -854,6 +863,12 @@ static void set_region(struct core_mmu_table_info *tbl_info,
 	}
 }
 
+/* May be overridden to follow secure I/O mapped by core_mmu_add_mapping() */
+__weak void core_mmu_io_sec_mapped(paddr_t pa __unused, vaddr_t va __unused,
+				   size_t size __unused)
+{
+}
+
 bool core_mmu_add_mapping(enum teecore_memtypes type, paddr_t addr, size_t len)
 {
 	struct core_mmu_table_info tbl_info;
@@ -916,6 +931,10 @@ bool core_mmu_add_mapping(enum teecore_memtypes type, paddr_t addr, size_t len)
 	map->pa = p;
 
 	set_region(&tbl_info, map);
+
+	if (type == MEM_AREA_IO_SEC)
+		core_mmu_io_sec_mapped(map->pa, map->va, map->size);
+
 	return true;
 }
 
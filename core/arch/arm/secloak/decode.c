@@ -0,0 +1,615 @@
+#include <secloak/decode.h>
+
+#include <string.h>
+
+#define BITS(value, hi, lo) (((value) >> (lo)) & ((1U << ((hi) - (lo) + 1)) - 1))
+#define BIT_SET(value, bit) (((value) >> (bit)) & 1)
+
+static inline void emu_decode_reset(struct emu_instr *d, int length) {
+	memset(d, 0, sizeof(*d));
+	d->length = length;
+	d->cond = EMU_COND_AL;
+	d->size = 4;
+	d->add = true;
+	d->index = true;
+}
+
+static bool emu_decode_arm_single(uint32_t instr, struct emu_instr *d) {
+	bool load = BIT_SET(instr, 20);
+	bool register_form = BIT_SET(instr, 25);
+
+	// Media instructions share this space, but never access memory
+	if (register_form && BIT_SET(instr, 4)) {
+		return false;
+	}
+
+	d->op = load ? EMU_OP_LOAD : EMU_OP_STORE;
+	d->size = BIT_SET(instr, 22) ? 1 : 4;
+	d->rn = BITS(instr, 19, 16);
+	d->rt = BITS(instr, 15, 12);
+	d->add = BIT_SET(instr, 23);
+	d->index = BIT_SET(instr, 24);
+	// Post-indexed forms always write back (W selects the unprivileged variant)
+	d->wback = !d->index || BIT_SET(instr, 21);
+
+	if (register_form) {
+		d->reg_offset = true;
+		d->rm = BITS(instr, 3, 0);
+		d->shift_type = BITS(instr, 6, 5);
+		d->shift_amount = BITS(instr, 11, 7);
+	} else {
+		d->imm = BITS(instr, 11, 0);
+	}
+
+	return true;
+}
+
+static bool emu_decode_arm_extra(uint32_t instr, struct emu_instr *d) {
+	// Multiplies, swaps and exclusives have op2 of 0
+	uint32_t op2 = BITS(instr, 6, 5);
+	if (((instr & 0x90) != 0x90) || (op2 == 0)) {
+		return false;
+	}
+
+	bool load = BIT_SET(instr, 20);
+	switch (op2) {
+		case 1:
+			d->op = load ? EMU_OP_LOAD : EMU_OP_STORE;
+			d->size = 2;
+			break;
+		case 2:
+			d->op = load ? EMU_OP_LOAD : EMU_OP_LOAD_DUAL;
+			d->size = load ? 1 : 4;
+			d->sign = load;
+			break;
+		case 3:
+			d->op = load ? EMU_OP_LOAD : EMU_OP_STORE_DUAL;
+			d->size = load ? 2 : 4;
+			d->sign = load;
+			break;
+	}
+
+	d->rn = BITS(instr, 19, 16);
+	d->rt = BITS(instr, 15, 12);
+	d->add = BIT_SET(instr, 23);
+	d->index = BIT_SET(instr, 24);
+	d->wback = !d->index || BIT_SET(instr, 21);
+
+	if (BIT_SET(instr, 22)) {
+		d->imm = (BITS(instr, 11, 8) << 4) | BITS(instr, 3, 0);
+	} else {
+		d->reg_offset = true;
+		d->rm = BITS(instr, 3, 0);
+	}
+
+	if ((d->op == EMU_OP_LOAD_DUAL) || (d->op == EMU_OP_STORE_DUAL)) {
+		if ((d->rt & 1) || (d->rt == 14)) {
+			return false;
+		}
+		d->rt2 = d->rt + 1;
+	}
+
+	return true;
+}
+
+static bool emu_decode_arm_multiple(uint32_t instr, struct emu_instr *d) {
+	// User bank and exception return forms are not supported
+	if (BIT_SET(instr, 22)) {
+		return false;
+	}
+
+	d->op = BIT_SET(instr, 20) ? EMU_OP_LOAD_MULTIPLE : EMU_OP_STORE_MULTIPLE;
+	d->rn = BITS(instr, 19, 16);
+	d->add = BIT_SET(instr, 23);
+	d->index = BIT_SET(instr, 24);
+	d->wback = BIT_SET(instr, 21);
+	d->reglist = BITS(instr, 15, 0);
+
+	return (d->reglist != 0);
+}
+
+static bool emu_decode_arm_data(uint32_t instr, struct emu_instr *d) {
+	uint32_t opcode = BITS(instr, 24, 21);
+	bool compare = ((opcode & 0xC) == 0x8);
+
+	d->op = EMU_OP_DATA;
+	d->alu = opcode;
+	d->setflags = BIT_SET(instr, 20);
+	d->rn = BITS(instr, 19, 16);
+	d->rd = BITS(instr, 15, 12);
+
+	// Compares without S are the miscellaneous instructions, except for MOVW, MOVT and NOP
+	if (compare && !d->setflags) {
+		if (BITS(instr, 27, 20) == 0x30) {
+			d->alu = EMU_ALU_MOV;
+		} else if (BITS(instr, 27, 20) == 0x34) {
+			d->alu = EMU_ALU_MOVT;
+		} else if (BITS(instr, 27, 0) == 0x320F000) {
+			d->op = EMU_OP_NOP;
+			return true;
+		} else {
+			return false;
+		}
+		d->imm = (BITS(instr, 19, 16) << 12) | BITS(instr, 11, 0);
+		d->rn = 0;
+		return (d->rd != 15);
+	}
+
+	if (BIT_SET(instr, 25)) {
+		uint32_t imm8 = BITS(instr, 7, 0);
+		uint32_t rotate = BITS(instr, 11, 8) * 2;
+		d->imm = (rotate == 0) ? imm8 : ((imm8 >> rotate) | (imm8 << (32 - rotate)));
+		d->imm_carry = (rotate != 0);
+	} else {
+		d->reg_offset = true;
+		d->rm = BITS(instr, 3, 0);
+		d->shift_type = BITS(instr, 6, 5);
+		if (BIT_SET(instr, 4)) {
+			d->reg_shift = true;
+			d->rs = BITS(instr, 11, 8);
+			if ((d->rd == 15) || (d->rn == 15) || (d->rm == 15) || (d->rs == 15)) {
+				return false;
+			}
+		} else {
+			d->shift_amount = BITS(instr, 11, 7);
+		}
+	}
+
+	// Writes to the PC are branches
+	return compare || (d->rd != 15);
+}
+
+static bool emu_decode_arm_barrier(uint32_t instr, struct emu_instr *d) {
+	// DSB, DMB and ISB
+	if ((BITS(instr, 31, 8) == 0xF57FF0) && (BITS(instr, 7, 4) >= 4) && (BITS(instr, 7, 4) <= 6)) {
+		d->op = EMU_OP_BARRIER;
+		return true;
+	}
+	return false;
+}
+
+bool emu_decode_arm(uint32_t instr, struct emu_instr *d) {
+	emu_decode_reset(d, 4);
+
+	// The unconditional space only holds hints and system instructions
+	if (BITS(instr, 31, 28) == 0xF) {
+		return emu_decode_arm_barrier(instr, d);
+	}
+	d->cond = BITS(instr, 31, 28);
+
+	bool success;
+	switch (BITS(instr, 27, 25)) {
+		case 0x0:
+			if ((instr & 0x90) == 0x90) {
+				success = emu_decode_arm_extra(instr, d);
+			} else {
+				success = emu_decode_arm_data(instr, d);
+			}
+			break;
+		case 0x1:
+			success = emu_decode_arm_data(instr, d);
+			break;
+		case 0x2:
+		case 0x3:
+			success = emu_decode_arm_single(instr, d);
+			break;
+		case 0x4:
+			success = emu_decode_arm_multiple(instr, d);
+			break;
+		default:
+			success = false;
+			break;
+	}
+
+	// Writing back to the PC is unpredictable
+	return success && !(d->wback && (d->rn == 15));
+}
+
+static bool emu_decode_thumb16(uint16_t hw, struct emu_instr *d) {
+	static const uint8_t reg_sizes[8] = { 4, 2, 1, 1, 4, 2, 1, 2 };
+
+	if (BITS(hw, 15, 11) == 0x09) {
+		// LDR (literal)
+		d->op = EMU_OP_LOAD;
+		d->rt = BITS(hw, 10, 8);
+		d->rn = 15;
+		d->imm = BITS(hw, 7, 0) << 2;
+	} else if (BITS(hw, 15, 12) == 0x5) {
+		// Load/store (register offset)
+		uint32_t opb = BITS(hw, 11, 9);
+		d->op = (opb >= 3) ? EMU_OP_LOAD : EMU_OP_STORE;
+		d->size = reg_sizes[opb];
+		d->sign = (opb == 3) || (opb == 7);
+		d->rm = BITS(hw, 8, 6);
+		d->rn = BITS(hw, 5, 3);
+		d->rt = BITS(hw, 2, 0);
+		d->reg_offset = true;
+	} else if ((BITS(hw, 15, 13) == 0x3) || (BITS(hw, 15, 12) == 0x8)) {
+		// Load/store word, byte and halfword (immediate)
+		uint32_t op = BITS(hw, 15, 11);
+		d->op = BIT_SET(hw, 11) ? EMU_OP_LOAD : EMU_OP_STORE;
+		d->size = (op <= 0x0D) ? 4 : ((op <= 0x0F) ? 1 : 2);
+		d->rn = BITS(hw, 5, 3);
+		d->rt = BITS(hw, 2, 0);
+		d->imm = BITS(hw, 10, 6) * d->size;
+	} else if (BITS(hw, 15, 12) == 0x9) {
+		// Load/store word (SP-relative)
+		d->op = BIT_SET(hw, 11) ? EMU_OP_LOAD : EMU_OP_STORE;
+		d->rt = BITS(hw, 10, 8);
+		d->rn = 13;
+		d->imm = BITS(hw, 7, 0) << 2;
+	} else if (BITS(hw, 15, 12) == 0xC) {
+		// STMIA/LDMIA, which only writes back when Rn is not loaded
+		bool load = BIT_SET(hw, 11);
+		d->op = load ? EMU_OP_LOAD_MULTIPLE : EMU_OP_STORE_MULTIPLE;
+		d->rn = BITS(hw, 10, 8);
+		d->reglist = BITS(hw, 7, 0);
+		d->index = false;
+		d->wback = !load || !(d->reglist & (1 << d->rn));
+	} else if ((hw & 0xFE00) == 0xB400) {
+		// PUSH, which is STMDB SP!
+		d->op = EMU_OP_STORE_MULTIPLE;
+		d->rn = 13;
+		d->reglist = BITS(hw, 7, 0) | (BIT_SET(hw, 8) << 14);
+		d->add = false;
+		d->wback = true;
+	} else if ((hw & 0xFE00) == 0xBC00) {
+		// POP, which is LDMIA SP!
+		d->op = EMU_OP_LOAD_MULTIPLE;
+		d->rn = 13;
+		d->reglist = BITS(hw, 7, 0) | (BIT_SET(hw, 8) << 15);
+		d->index = false;
+		d->wback = true;
+	} else {
+		return false;
+	}
+
+	if ((d->op == EMU_OP_LOAD_MULTIPLE) || (d->op == EMU_OP_STORE_MULTIPLE)) {
+		return (d->reglist != 0);
+	}
+
+	return true;
+}
+
+static bool emu_decode_thumb16_data(uint16_t hw, struct emu_instr *d) {
+	d->op = EMU_OP_DATA;
+	d->setflags = true;
+
+	if ((BITS(hw, 15, 13) == 0) && (BITS(hw, 12, 11) != 3)) {
+		// LSL, LSR and ASR (immediate), as a MOV of a shifted register
+		d->alu = EMU_ALU_MOV;
+		d->rd = BITS(hw, 2, 0);
+		d->rm = BITS(hw, 5, 3);
+		d->reg_offset = true;
+		d->shift_type = BITS(hw, 12, 11);
+		d->shift_amount = BITS(hw, 10, 6);
+	} else if (BITS(hw, 15, 11) == 0x03) {
+		// ADD and SUB (register or 3-bit immediate)
+		d->alu = BIT_SET(hw, 9) ? EMU_ALU_SUB : EMU_ALU_ADD;
+		d->rd = BITS(hw, 2, 0);
+		d->rn = BITS(hw, 5, 3);
+		if (BIT_SET(hw, 10)) {
+			d->imm = BITS(hw, 8, 6);
+		} else {
+			d->reg_offset = true;
+			d->rm = BITS(hw, 8, 6);
+		}
+	} else if (BITS(hw, 15, 13) == 0x1) {
+		// MOV, CMP, ADD and SUB (8-bit immediate)
+		static const uint8_t alus[4] = { EMU_ALU_MOV, EMU_ALU_CMP, EMU_ALU_ADD, EMU_ALU_SUB };
+		d->alu = alus[BITS(hw, 12, 11)];
+		d->rd = BITS(hw, 10, 8);
+		d->rn = d->rd;
+		d->imm = BITS(hw, 7, 0);
+	} else if (BITS(hw, 15, 10) == 0x10) {
+		// Data-processing (register), with the shifts by register as a MOV
+		static const int8_t alus[16] = {
+			EMU_ALU_AND, EMU_ALU_EOR, EMU_ALU_MOV, EMU_ALU_MOV,
+			EMU_ALU_MOV, EMU_ALU_ADC, EMU_ALU_SBC, EMU_ALU_MOV,
+			EMU_ALU_TST, EMU_ALU_RSB, EMU_ALU_CMP, EMU_ALU_CMN,
+			EMU_ALU_ORR, -1, EMU_ALU_BIC, EMU_ALU_MVN,
+		};
+		uint32_t opcode = BITS(hw, 9, 6);
+		if (alus[opcode] < 0) {
+			return false;
+		}
+		d->alu = alus[opcode];
+		d->rd = BITS(hw, 2, 0);
+		d->rn = d->rd;
+		d->rm = BITS(hw, 5, 3);
+		d->reg_offset = true;
+
+		switch (opcode) {
+			case 0x2:
+			case 0x3:
+			case 0x4:
+			case 0x7:
+				d->reg_shift = true;
+				d->rs = d->rm;
+				d->rm = d->rd;
+				d->shift_type = (opcode == 0x7) ? EMU_SHIFT_ROR : (opcode - 0x2);
+				break;
+			case 0x9:
+				// NEG, which is RSB with an immediate of 0
+				d->rn = d->rm;
+				d->reg_offset = false;
+				break;
+		}
+	} else if (BITS(hw, 15, 10) == 0x11) {
+		// ADD, CMP and MOV (high registers), where the rest are branches
+		static const int8_t alus[4] = { EMU_ALU_ADD, EMU_ALU_CMP, EMU_ALU_MOV, -1 };
+		uint32_t opcode = BITS(hw, 9, 8);
+		if (alus[opcode] < 0) {
+			return false;
+		}
+		d->alu = alus[opcode];
+		d->rd = (BIT_SET(hw, 7) << 3) | BITS(hw, 2, 0);
+		d->rn = d->rd;
+		d->rm = BITS(hw, 6, 3);
+		d->reg_offset = true;
+		d->setflags = (d->alu == EMU_ALU_CMP);
+		if ((d->rd == 15) && !d->setflags) {
+			return false;
+		}
+	} else if (BITS(hw, 15, 11) == 0x15) {
+		// ADD (SP plus immediate)
+		d->alu = EMU_ALU_ADD;
+		d->rd = BITS(hw, 10, 8);
+		d->rn = 13;
+		d->imm = BITS(hw, 7, 0) << 2;
+		d->setflags = false;
+	} else if (BITS(hw, 15, 8) == 0xB0) {
+		// ADD and SUB (SP plus immediate)
+		d->alu = BIT_SET(hw, 7) ? EMU_ALU_SUB : EMU_ALU_ADD;
+		d->rd = 13;
+		d->rn = 13;
+		d->imm = BITS(hw, 6, 0) << 2;
+		d->setflags = false;
+	} else if (hw == 0xBF00) {
+		d->op = EMU_OP_NOP;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+static bool emu_decode_thumb32_single(uint16_t hw1, uint16_t hw2, struct emu_instr *d) {
+	bool load = BIT_SET(hw1, 4);
+	uint32_t size = BITS(hw1, 6, 5);
+
+	// There are no doubleword or signed word forms, and no signed stores
+	if ((size == 3) || (BIT_SET(hw1, 8) && (!load || (size == 2)))) {
+		return false;
+	}
+
+	d->op = load ? EMU_OP_LOAD : EMU_OP_STORE;
+	d->size = 1 << size;
+	d->sign = BIT_SET(hw1, 8);
+	d->rn = BITS(hw1, 3, 0);
+	d->rt = BITS(hw2, 15, 12);
+
+	// Byte and halfword loads into the PC are preload hints
+	if (load && (d->rt == 15) && (d->size != 4)) {
+		return false;
+	}
+
+	if (d->rn == 15) {
+		// Literal, with U in bit 7
+		if (!load) {
+			return false;
+		}
+		d->add = BIT_SET(hw1, 7);
+		d->imm = BITS(hw2, 11, 0);
+	} else if (BIT_SET(hw1, 7)) {
+		d->imm = BITS(hw2, 11, 0);
+	} else if (BIT_SET(hw2, 11)) {
+		// 8-bit immediate with P, U and W, or the unprivileged variant (P = 1, U = 1, W = 0)
+		d->index = BIT_SET(hw2, 10);
+		d->add = BIT_SET(hw2, 9);
+		d->wback = BIT_SET(hw2, 8);
+		d->imm = BITS(hw2, 7, 0);
+		if (!d->index && !d->wback) {
+			return false;
+		}
+	} else if (BITS(hw2, 11, 6) == 0) {
+		d->reg_offset = true;
+		d->rm = BITS(hw2, 3, 0);
+		d->shift_type = EMU_SHIFT_LSL;
+		d->shift_amount = BITS(hw2, 5, 4);
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+static bool emu_decode_thumb32_dual(uint16_t hw1, uint16_t hw2, struct emu_instr *d) {
+	d->index = BIT_SET(hw1, 8);
+	d->add = BIT_SET(hw1, 7);
+	d->wback = BIT_SET(hw1, 5);
+
+	// P = 0 and W = 0 encode the exclusives and table branches
+	if (!d->index && !d->wback) {
+		return false;
+	}
+
+	d->op = BIT_SET(hw1, 4) ? EMU_OP_LOAD_DUAL : EMU_OP_STORE_DUAL;
+	d->rn = BITS(hw1, 3, 0);
+	d->rt = BITS(hw2, 15, 12);
+	d->rt2 = BITS(hw2, 11, 8);
+	d->imm = BITS(hw2, 7, 0) << 2;
+
+	return true;
+}
+
+static bool emu_decode_thumb32_multiple(uint16_t hw1, uint16_t hw2, struct emu_instr *d) {
+	// Only IA (op = 01) and DB (op = 10), as the others are SRS and RFE
+	uint32_t op = BITS(hw1, 8, 7);
+	if ((op != 1) && (op != 2)) {
+		return false;
+	}
+
+	d->op = BIT_SET(hw1, 4) ? EMU_OP_LOAD_MULTIPLE : EMU_OP_STORE_MULTIPLE;
+	d->rn = BITS(hw1, 3, 0);
+	d->add = (op == 1);
+	d->index = (op == 2);
+	d->wback = BIT_SET(hw1, 5);
+	d->reglist = hw2;
+
+	return (d->reglist != 0);
+}
+
+static bool emu_decode_thumb32_alu(uint32_t opcode, struct emu_instr *d) {
+	bool compare = (d->rd == 15) && d->setflags;
+
+	switch (opcode) {
+		case 0x0:
+			d->alu = compare ? EMU_ALU_TST : EMU_ALU_AND;
+			break;
+		case 0x1:
+			d->alu = EMU_ALU_BIC;
+			break;
+		case 0x2:
+			d->alu = (d->rn == 15) ? EMU_ALU_MOV : EMU_ALU_ORR;
+			break;
+		case 0x3:
+			d->alu = (d->rn == 15) ? EMU_ALU_MVN : EMU_ALU_ORN;
+			break;
+		case 0x4:
+			d->alu = compare ? EMU_ALU_TEQ : EMU_ALU_EOR;
+			break;
+		case 0x8:
+			d->alu = compare ? EMU_ALU_CMN : EMU_ALU_ADD;
+			break;
+		case 0xA:
+			d->alu = EMU_ALU_ADC;
+			break;
+		case 0xB:
+			d->alu = EMU_ALU_SBC;
+			break;
+		case 0xD:
+			d->alu = compare ? EMU_ALU_CMP : EMU_ALU_SUB;
+			break;
+		case 0xE:
+			d->alu = EMU_ALU_RSB;
+			break;
+		default:
+			return false;
+	}
+
+	// Only the compares may have an Rd of 15
+	return (d->rd != 15) || ((d->alu & 0xC) == 0x8);
+}
+
+static uint32_t emu_thumb_expand_imm(uint32_t imm12, bool *carry) {
+	uint32_t imm8 = BITS(imm12, 7, 0);
+
+	*carry = false;
+	switch (BITS(imm12, 11, 8)) {
+		case 0x0:
+			return imm8;
+		case 0x1:
+			return (imm8 << 16) | imm8;
+		case 0x2:
+			return (imm8 << 24) | (imm8 << 8);
+		case 0x3:
+			return (imm8 << 24) | (imm8 << 16) | (imm8 << 8) | imm8;
+		default: {
+			uint32_t unrotated = 0x80 | BITS(imm12, 6, 0);
+			uint32_t rotate = BITS(imm12, 11, 7);
+			*carry = true;
+			return (unrotated >> rotate) | (unrotated << (32 - rotate));
+		}
+	}
+}
+
+static bool emu_decode_thumb32_data(uint16_t hw1, uint16_t hw2, struct emu_instr *d) {
+	// DSB, DMB and ISB, then NOP
+	if ((hw1 == 0xF3BF) && ((hw2 & 0xFFC0) == 0x8F40) && (BITS(hw2, 5, 4) != 3)) {
+		d->op = EMU_OP_BARRIER;
+		return true;
+	} else if ((hw1 == 0xF3AF) && (hw2 == 0x8000)) {
+		d->op = EMU_OP_NOP;
+		return true;
+	}
+
+	d->op = EMU_OP_DATA;
+	d->rd = BITS(hw2, 11, 8);
+	d->rn = BITS(hw1, 3, 0);
+	d->setflags = BIT_SET(hw1, 4);
+
+	if (((hw1 & 0xFF80) == 0xFA00) && ((hw2 & 0xF0F0) == 0xF000)) {
+		// LSL, LSR, ASR and ROR (register), as a MOV of a shifted register
+		d->alu = EMU_ALU_MOV;
+		d->reg_offset = true;
+		d->reg_shift = true;
+		d->rm = d->rn;
+		d->rn = 0;
+		d->rs = BITS(hw2, 3, 0);
+		d->shift_type = BITS(hw1, 6, 5);
+		return (d->rd != 15);
+	}
+
+	// The rest of this space is branches and miscellaneous control
+	if (BIT_SET(hw2, 15)) {
+		return false;
+	}
+
+	uint32_t imm12 = (BIT_SET(hw1, 10) << 11) | (BITS(hw2, 14, 12) << 8) | BITS(hw2, 7, 0);
+	if ((hw1 & 0xFA00) == 0xF000) {
+		// Data-processing (modified immediate)
+		d->imm = emu_thumb_expand_imm(imm12, &d->imm_carry);
+		return emu_decode_thumb32_alu(BITS(hw1, 8, 5), d);
+	} else if ((hw1 & 0xFE00) == 0xEA00) {
+		// Data-processing (shifted register)
+		d->reg_offset = true;
+		d->rm = BITS(hw2, 3, 0);
+		d->shift_type = BITS(hw2, 5, 4);
+		d->shift_amount = (BITS(hw2, 14, 12) << 2) | BITS(hw2, 7, 6);
+		return emu_decode_thumb32_alu(BITS(hw1, 8, 5), d);
+	} else if (((hw1 & 0xFBF0) == 0xF240) || ((hw1 & 0xFBF0) == 0xF2C0)) {
+		// MOVW and MOVT
+		d->alu = BIT_SET(hw1, 7) ? EMU_ALU_MOVT : EMU_ALU_MOV;
+		d->imm = (BITS(hw1, 3, 0) << 12) | imm12;
+		d->rn = 0;
+		d->setflags = false;
+	} else if ((((hw1 & 0xFBF0) == 0xF200) || ((hw1 & 0xFBF0) == 0xF2A0)) && (d->rn != 15)) {
+		// ADDW and SUBW, where an Rn of 15 is ADR
+		d->alu = BIT_SET(hw1, 7) ? EMU_ALU_SUB : EMU_ALU_ADD;
+		d->imm = imm12;
+		d->setflags = false;
+	} else {
+		return false;
+	}
+
+	return (d->rd != 15);
+}
+
+bool emu_decode_thumb(uint16_t hw1, uint16_t hw2, struct emu_instr *d) {
+	if (!emu_thumb_is_32bit(hw1)) {
+		emu_decode_reset(d, 2);
+		if (emu_decode_thumb16(hw1, d)) {
+			return true;
+		}
+
+		emu_decode_reset(d, 2);
+		return emu_decode_thumb16_data(hw1, d);
+	}
+
+	emu_decode_reset(d, 4);
+
+	bool success;
+	if ((hw1 & 0xFE00) == 0xF800) {
+		success = emu_decode_thumb32_single(hw1, hw2, d);
+	} else if ((hw1 & 0xFE40) == 0xE840) {
+		success = emu_decode_thumb32_dual(hw1, hw2, d);
+	} else if ((hw1 & 0xFE40) == 0xE800) {
+		success = emu_decode_thumb32_multiple(hw1, hw2, d);
+	} else {
+		success = emu_decode_thumb32_data(hw1, hw2, d);
+	}
+
+	// Writing back to the PC is unpredictable
+	return success && !(d->wback && (d->rn == 15));
+}
@@ -1,11 +1,14 @@
 #include <secloak/emulation.h>
+#include <secloak/decode.h>
 
 #include <arm.h>
 #include <compiler.h>
 #include <drivers/dt.h>
+#include <drivers/imx_csu.h>
 #include <errno.h>
 #include <kernel/misc.h>
 #include <kernel/panic.h>
+#include <kernel/spinlock.h>
 #include <initcall.h>
 #include <io.h>
 #include <malloc.h>
@@ -14,114 +17,2289 @@
 #include <platform_config.h>
 #include <string.h>
 
-static paddr_t emu_data_pstart;
-static vaddr_t emu_data_vstart;
-static size_t emu_data_size;
-static paddr_t emu_instr_pstart;
-static vaddr_t emu_instr_vstart;
-static size_t emu_instr_size;
+// Also read by the fast path in sm_da_entry, so the layout must not change
+struct emu_window {
+	paddr_t pstart;
+	vaddr_t vstart;
+	size_t size;
+};
+
+struct emu_window emu_instr_window;
+
+/*
+ * Secure mappings of device memory, sorted by physical address. These are
+ * collected from the static memory map when emulation is initialized, and from
+ * core_mmu_add_mapping as drivers map their devices. Regions cache the VA of
+ * their base when a window covering them is known, so the trap path does not
+ * need to search this table.
+ */
+#define EMU_MAX_DATA_WINDOWS 16
+
+struct emu_data_windows {
+	int num_windows;
+	struct emu_window windows[EMU_MAX_DATA_WINDOWS];
+};
+
+// Double-buffered, so that a new table can be built while the trap path reads the current one
+static struct emu_data_windows emu_data_window_tables[2];
+static struct emu_data_windows *volatile emu_data_windows = &emu_data_window_tables[0];
+
+static const struct emu_window *emu_data_window_find(paddr_t pa) {
+	const struct emu_data_windows *table = emu_data_windows;
+	int low = 0;
+	int high = table->num_windows - 1;
+
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		const struct emu_window *w = &table->windows[mid];
+		if (pa < w->pstart) {
+			high = mid - 1;
+		} else if ((pa - w->pstart) >= w->size) {
+			low = mid + 1;
+		} else {
+			return w;
+		}
+	}
+
+	return NULL;
+}
+
+// Returns the secure VA for [pa, pa + size), or 0 if no single window covers it
+static vaddr_t emu_data_vaddr(paddr_t pa, size_t size) {
+	const struct emu_window *w = emu_data_window_find(pa);
+	if (!w || ((w->size - (pa - w->pstart)) < size)) {
+		return 0;
+	}
+
+	return w->vstart + (pa - w->pstart);
+}
 
 static SLIST_HEAD(, region) regions = SLIST_HEAD_INITIALIZER(regions);
 
-int32_t emu_add_region(paddr_t base, uint32_t size, emu_check_t check) {
-	struct region *r = malloc(sizeof(struct region));
-	if (!r) {
-		return -ENOMEM;
+/*
+ * Page index for the emulated regions. Each 4KiB page of the physical address
+ * space maps to the set of regions that overlap it, so emu_check only has to
+ * look at the regions for the faulting page instead of walking every region.
+ * The index is a two-level radix table (1MiB sections of 4KiB pages), with
+ * sections allocated on demand. Region sets are reference counted and shared
+ * between all consecutive pages that are covered by the same regions.
+ */
+#define EMU_PAGE_SHIFT 12
+#define EMU_SECTION_SHIFT 20
+#define EMU_NUM_SECTIONS (1 << (32 - EMU_SECTION_SHIFT))
+#define EMU_PAGES_PER_SECTION (1 << (EMU_SECTION_SHIFT - EMU_PAGE_SHIFT))
+
+struct region_set {
+	int refs;
+	int num_regions;
+	struct region_set *next_retired;
+	struct region *regions[];
+};
+
+/*
+ * Each section also holds a compact policy word per page for the fast path in
+ * sm_da_entry, which handles word/byte LDR/STR accesses to pages that are
+ * entirely allow-all or deny-all without leaving assembly. The word holds the
+ * secure VA of the page in the upper bits and the policy class in the lower
+ * bits. Sections are never freed, so the fast path can read them at any time.
+ */
+#define EMU_FAST_SLOW 0
+#define EMU_FAST_ALLOW 1
+#define EMU_FAST_DENY 2
+
+struct region_section {
+	struct region_set *pages[EMU_PAGES_PER_SECTION];
+	uint32_t fast[EMU_PAGES_PER_SECTION];
+};
+
+static struct region_section *sections[EMU_NUM_SECTIONS];
+uint32_t *emu_fast_table[EMU_NUM_SECTIONS];
+
+/*
+ * The trap path reads the index without taking any lock. Writers are
+ * serialized by emu_update_lock, and publish each page's new (immutable) set
+ * with a single pointer store. Sets and regions that are no longer reachable
+ * are retired rather than freed, and only freed once every core has been seen
+ * outside of emu_handle, which is the quiescent point. Each core counts its
+ * entries to and exits from emu_handle in emu_rcu_seq, so it is odd while the
+ * core may still hold a reference from before the update.
+ */
+static unsigned int emu_update_lock = SPINLOCK_UNLOCK;
+static volatile uint32_t emu_rcu_seq[CFG_TEE_CORE_NB_CORE];
+static struct region_set *emu_retired_sets;
+static SLIST_HEAD(, region) emu_retired_regions = SLIST_HEAD_INITIALIZER(emu_retired_regions);
+
+static inline void emu_read_begin(void) {
+	emu_rcu_seq[get_core_pos()]++;
+	dmb();
+}
+
+static inline void emu_read_end(void) {
+	dmb();
+	emu_rcu_seq[get_core_pos()]++;
+}
+
+/*
+ * Waits until no core can still be using anything that was unpublished before
+ * the call. Exceptions must be masked, so that the caller cannot migrate away
+ * from the core it skips.
+ */
+static void emu_rcu_synchronize(void) {
+	uint32_t seq[CFG_TEE_CORE_NB_CORE];
+	int self = get_core_pos();
+
+	dmb();
+	for (int c = 0; c < CFG_TEE_CORE_NB_CORE; c++) {
+		seq[c] = emu_rcu_seq[c];
+	}
+
+	// A writer called from emu_handle (e.g. by a policy hook) cannot wait on itself
+	for (int c = 0; c < CFG_TEE_CORE_NB_CORE; c++) {
+		if ((c != self) && (seq[c] & 1)) {
+			while (emu_rcu_seq[c] == seq[c]) {
+				;
+			}
+		}
+	}
+
+	dmb();
+}
+
+static inline uint32_t emu_update_begin(void) {
+	return cpu_spin_lock_xsave(&emu_update_lock);
+}
+
+static void emu_update_end(uint32_t exceptions) {
+	struct region_set *set = emu_retired_sets;
+	struct region *r = SLIST_FIRST(&emu_retired_regions);
+	emu_retired_sets = NULL;
+	SLIST_INIT(&emu_retired_regions);
+
+	// Other writers may go ahead, but this one stays on its core until the grace period is over
+	cpu_spin_unlock(&emu_update_lock);
+	if (set || r) {
+		emu_rcu_synchronize();
+	}
+	thread_unmask_exceptions(exceptions);
+
+	while (set) {
+		struct region_set *next = set->next_retired;
+		free(set);
+		set = next;
+	}
+
+	while (r) {
+		struct region *next = SLIST_NEXT(r, entry);
+		free(r);
+		r = next;
+	}
+}
+
+static inline void emu_retire_region(struct region *r) {
+	SLIST_INSERT_HEAD(&emu_retired_regions, r, entry);
+}
+
+static inline struct region_set *region_set_get(struct region_set *set) {
+	if (set) {
+		set->refs++;
+	}
+
+	return set;
+}
+
+static inline void region_set_put(struct region_set *set) {
+	if (set && (--set->refs == 0)) {
+		set->next_retired = emu_retired_sets;
+		emu_retired_sets = set;
+	}
+}
+
+// Returns a new reference to the set containing the regions of 'set' plus 'r'
+static struct region_set *region_set_with(struct region_set *set, struct region *r) {
+	int num_regions = set ? set->num_regions : 0;
+
+	struct region_set *new_set = malloc(sizeof(*new_set) + (sizeof(new_set->regions[0]) * (num_regions + 1)));
+	if (!new_set) {
+		return NULL;
+	}
+
+	// Newest regions are checked first, matching the previous list order
+	new_set->refs = 1;
+	new_set->num_regions = num_regions + 1;
+	new_set->regions[0] = r;
+	for (int i = 0; i < num_regions; i++) {
+		new_set->regions[i + 1] = set->regions[i];
+	}
+
+	return new_set;
+}
+
+// Returns a new reference to the set containing the regions of 'set' minus 'r'
+static struct region_set *region_set_without(struct region_set *set, struct region *r) {
+	int index = -1;
+	for (int i = 0; set && (i < set->num_regions); i++) {
+		if (set->regions[i] == r) {
+			index = i;
+			break;
+		}
+	}
+
+	if (index < 0) {
+		return region_set_get(set);
+	}
+
+	if (set->num_regions == 1) {
+		return NULL;
+	}
+
+	struct region_set *new_set = malloc(sizeof(*new_set) + (sizeof(new_set->regions[0]) * (set->num_regions - 1)));
+	if (!new_set) {
+		// The region is about to be freed, so it cannot be left in the index
+		EMSG("[EMU] Out of memory while removing region 0x%lX", r->base);
+		panic();
+	}
+
+	new_set->refs = 1;
+	new_set->num_regions = 0;
+	for (int i = 0; i < set->num_regions; i++) {
+		if (i != index) {
+			new_set->regions[new_set->num_regions++] = set->regions[i];
+		}
+	}
+
+	return new_set;
+}
+
+static inline bool emu_trace_enabled(void);
+
+static uint32_t emu_fast_classify(paddr_t page_paddr, struct region_set *set) {
+#ifdef CFG_SECLOAK_EMU_STATS
+	// Every trap must reach emu_handle to be counted in the statistics
+	return EMU_FAST_SLOW;
+#endif
+
+	// Traced accesses must reach emu_handle to be recorded
+	if (emu_trace_enabled()) {
+		return EMU_FAST_SLOW;
+	}
+
+	vaddr_t page_vaddr = emu_data_vaddr(page_paddr, 1 << EMU_PAGE_SHIFT);
+	if (!page_vaddr) {
+		return EMU_FAST_SLOW;
+	}
+
+	bool deny = false;
+	for (int i = 0; set && (i < set->num_regions); i++) {
+		struct region *r = set->regions[i];
+
+		// Regions that only partially cover the page need the bounds check in emu_check
+		if ((r->base > page_paddr) || ((page_paddr + (1 << EMU_PAGE_SHIFT) - 1 - r->base) >= r->size)) {
+			return EMU_FAST_SLOW;
+		}
+
+		if (r->check == emu_deny_all) {
+#if CFG_SECLOAK_EMU_STORM_TRAPS > 0
+			// Denied accesses must reach emu_handle to be counted towards a storm
+			return EMU_FAST_SLOW;
+#endif
+			deny = true;
+		} else if (r->check != emu_allow_all) {
+			return EMU_FAST_SLOW;
+		}
+	}
+
+	if (deny) {
+		return EMU_FAST_DENY;
+	}
+
+	return page_vaddr | EMU_FAST_ALLOW;
+}
+
+static void emu_fast_update(uint32_t first, uint32_t last, bool to_slow) {
+	for (uint32_t page = first; page <= last; page++) {
+		struct region_section *section = sections[page >> (EMU_SECTION_SHIFT - EMU_PAGE_SHIFT)];
+		if (!section) {
+			continue;
+		}
+
+		uint32_t p = page & (EMU_PAGES_PER_SECTION - 1);
+		if (to_slow) {
+			section->fast[p] = EMU_FAST_SLOW;
+		} else {
+			section->fast[p] = emu_fast_classify((paddr_t)page << EMU_PAGE_SHIFT, section->pages[p]);
+		}
+	}
+
+	dsb();
+}
+
+static bool emu_index_update(struct region *r, bool insert) {
+	bool success = true;
+
+	uint32_t first = r->base >> EMU_PAGE_SHIFT;
+	uint32_t last = (r->base + r->size - 1) >> EMU_PAGE_SHIFT;
+
+	// Send the fast path to the C path while the sets are being changed
+	emu_fast_update(first, last, true);
+
+	// Consecutive pages usually share a set, so only derive a new set on changes
+	struct region_set *old_set = NULL;
+	struct region_set *new_set = NULL;
+	bool cached = false;
+
+	for (uint32_t page = first; page <= last; page++) {
+		uint32_t s = page >> (EMU_SECTION_SHIFT - EMU_PAGE_SHIFT);
+		if (!sections[s]) {
+			if (!insert) {
+				continue;
+			}
+
+			struct region_section *section = calloc(1, sizeof(struct region_section));
+			if (!section) {
+				success = false;
+				break;
+			}
+
+			// The section must be cleared before the trap path can see it
+			dmb();
+			sections[s] = section;
+			emu_fast_table[s] = section->fast;
+		}
+
+		struct region_set **slot = &sections[s]->pages[page & (EMU_PAGES_PER_SECTION - 1)];
+		if (!cached || (*slot != old_set)) {
+			region_set_put(old_set);
+			region_set_put(new_set);
+
+			old_set = region_set_get(*slot);
+			new_set = insert ? region_set_with(old_set, r) : region_set_without(old_set, r);
+			cached = true;
+
+			if (insert && !new_set) {
+				success = false;
+				break;
+			}
+		}
+
+		if (*slot != new_set) {
+			struct region_set *prev = *slot;
+			dmb();
+			*slot = region_set_get(new_set);
+			region_set_put(prev);
+		}
+	}
+
+	region_set_put(old_set);
+	region_set_put(new_set);
+
+	emu_fast_update(first, last, false);
+
+	return success;
+}
+
+static inline struct region_set *emu_lookup(paddr_t address) {
+	struct region_section *section = sections[address >> EMU_SECTION_SHIFT];
+	if (!section) {
+		return NULL;
+	}
+
+	return section->pages[(address >> EMU_PAGE_SHIFT) & (EMU_PAGES_PER_SECTION - 1)];
+}
+
+static bool emu_check_allows_all(emu_check_t check, struct emu_policy *policy) {
+	return (check == emu_allow_all) || (policy && (policy->num_regs == 0));
+}
+
+static inline bool emu_region_allows_all(struct region *r) {
+	return emu_check_allows_all(r->check, r->policy);
+}
+
+bool emu_range_allows_all(paddr_t base, size_t size) {
+	bool covered = false;
+	bool restricted = false;
+	uint32_t exceptions = emu_update_begin();
+
+	struct region *r;
+	SLIST_FOREACH(r, &regions, entry) {
+		if ((r->base < base + size) && (base < r->base + r->size)) {
+			if (!emu_region_allows_all(r)) {
+				restricted = true;
+				break;
+			}
+			if ((r->base <= base) && ((base + size - r->base) <= r->size)) {
+				covered = true;
+			}
+		}
+	}
+
+	emu_update_end(exceptions);
+	return covered && !restricted;
+}
+
+/*
+ * Adds and removes regions in order under a single update, so that they are
+ * published together and wait for a single grace period. Regions are
+ * allocated up front. CSLs are restored before restrictive regions are added,
+ * and demoted once permissive regions are added or regions are removed.
+ */
+int32_t emu_update_regions(const struct emu_region_update *updates, int num_updates) {
+	if (num_updates <= 0) {
+		return 0;
+	}
+
+	// The added region for each update, or (never dereferenced after the update) the removed one
+	struct region **changed = calloc(num_updates, sizeof(*changed));
+	if (!changed) {
+		return -ENOMEM;
+	}
+
+	int32_t result = 0;
+	for (int u = 0; u < num_updates; u++) {
+		const struct emu_region_update *update = &updates[u];
+		if (!update->add) {
+			continue;
+		}
+
+		struct region *r = (update->size > 0) ? malloc(sizeof(struct region)) : NULL;
+		if (!r) {
+			result = (update->size > 0) ? -ENOMEM : -EINVAL;
+			for (int a = 0; a < u; a++) {
+				free(changed[a]);
+			}
+			free(changed);
+			return result;
+		}
+
+		r->base = update->base;
+		r->size = update->size;
+		r->check = update->check;
+		r->policy = update->policy;
+		r->vbase = emu_data_vaddr(update->base, update->size);
+		r->storms = 0;
+		r->storm_aborts = 0;
+		changed[u] = r;
+
+		// Accesses must trap again before a restrictive region can take effect
+		if (!emu_region_allows_all(r)) {
+			csu_restore_range(update->base, update->size);
+		}
+	}
+
+	uint32_t exceptions = emu_update_begin();
+
+	for (int u = 0; u < num_updates; u++) {
+		const struct emu_region_update *update = &updates[u];
+		struct region *r;
+
+		if (update->add) {
+			r = changed[u];
+			if (emu_index_update(r, true)) {
+				SLIST_INSERT_HEAD(&regions, r, entry);
+			} else {
+				// Undo the pages that were already updated, which the trap path may have seen
+				emu_index_update(r, false);
+				emu_retire_region(r);
+				changed[u] = NULL;
+				result = -ENOMEM;
+			}
+			continue;
+		}
+
+		SLIST_FOREACH(r, &regions, entry) {
+			if (r->base == update->base && r->size == update->size && r->check == update->check && r->policy == update->policy) {
+				SLIST_REMOVE(&regions, r, region, entry);
+				emu_index_update(r, false);
+				emu_retire_region(r);
+				changed[u] = r;
+				break;
+			}
+		}
+	}
+
+	emu_update_end(exceptions);
+
+	for (int u = 0; u < num_updates; u++) {
+		const struct emu_region_update *update = &updates[u];
+		if (changed[u] && (!update->add || emu_check_allows_all(update->check, update->policy))) {
+			csu_demote_range(update->base, update->size);
+		}
+	}
+
+	free(changed);
+	return result;
+}
+
+static int32_t __emu_add_region(paddr_t base, uint32_t size, emu_check_t check, struct emu_policy *policy) {
+	struct emu_region_update update = { .base = base, .size = size, .check = check, .policy = policy, .add = true };
+	return emu_update_regions(&update, 1);
+}
+
+void emu_add_data_window(paddr_t pa, vaddr_t va, size_t size) {
+	uint32_t exceptions = emu_update_begin();
+
+	const struct emu_data_windows *current = emu_data_windows;
+	if (emu_data_window_find(pa)) {
+		cpu_spin_unlock_xrestore(&emu_update_lock, exceptions);
+		return;
+	}
+
+	if (current->num_windows == EMU_MAX_DATA_WINDOWS) {
+		EMSG("[EMU] Too many data windows, not adding 0x%lX", (unsigned long)pa);
+		cpu_spin_unlock_xrestore(&emu_update_lock, exceptions);
+		return;
+	}
+
+	// Build the new table in the other buffer, which no core has used since the last update
+	struct emu_data_windows *next = (current == &emu_data_window_tables[0]) ? &emu_data_window_tables[1] : &emu_data_window_tables[0];
+	int i = current->num_windows;
+	while ((i > 0) && (current->windows[i - 1].pstart > pa)) {
+		next->windows[i] = current->windows[i - 1];
+		i--;
+	}
+	next->windows[i].pstart = pa;
+	next->windows[i].vstart = va;
+	next->windows[i].size = size;
+	while (i > 0) {
+		i--;
+		next->windows[i] = current->windows[i];
+	}
+	next->num_windows = current->num_windows + 1;
+
+	dmb();
+	emu_data_windows = next;
+
+	// Regions added before their device was mapped can now be accessed
+	struct region *r;
+	SLIST_FOREACH(r, &regions, entry) {
+		if (!r->vbase) {
+			r->vbase = emu_data_vaddr(r->base, r->size);
+		}
+	}
+
+	emu_fast_update(pa >> EMU_PAGE_SHIFT, (pa + size - 1) >> EMU_PAGE_SHIFT, false);
+
+	// The previous table is reused by the next update
+	cpu_spin_unlock(&emu_update_lock);
+	emu_rcu_synchronize();
+	thread_unmask_exceptions(exceptions);
+}
+
+// Devices mapped after boot can be accessed through the new mapping as well
+void core_mmu_io_sec_mapped(paddr_t pa, vaddr_t va, size_t size) {
+	emu_add_data_window(pa, va, size);
+}
+
+int32_t emu_add_region(paddr_t base, uint32_t size, emu_check_t check) {
+	return __emu_add_region(base, size, check, NULL);
+}
+
+int32_t emu_add_policy_region(paddr_t base, uint32_t size, struct emu_policy *policy) {
+	return __emu_add_region(base, size, emu_policy_check, policy);
+}
+
+static void __emu_remove_region(paddr_t base, uint32_t size, emu_check_t check, struct emu_policy *policy) {
+	struct emu_region_update update = { .base = base, .size = size, .check = check, .policy = policy, .add = false };
+	emu_update_regions(&update, 1);
+}
+
+void emu_remove_region(paddr_t base, uint32_t size, emu_check_t check) {
+	__emu_remove_region(base, size, check, NULL);
+}
+
+void emu_remove_policy_region(paddr_t base, uint32_t size, struct emu_policy *policy) {
+	__emu_remove_region(base, size, emu_policy_check, policy);
+}
+
+static inline struct emu_reg_policy *emu_policy_find(struct emu_policy *policy, uint32_t offset) {
+	for (int i = 0; i < policy->num_regs; i++) {
+		if (policy->regs[i].offset == offset) {
+			return &policy->regs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static inline bool emu_policy_eval(struct region *region, paddr_t address, enum emu_state state, uint32_t *value) {
+	uint32_t offset = address - region->base;
+
+	struct emu_reg_policy *reg = emu_policy_find(region->policy, offset);
+	if (!reg) {
+		return true;
+	}
+
+	uint32_t flags = reg->flags;
+	switch (state) {
+		case EMU_STATE_READ_BEFORE:
+			if (flags & EMU_POLICY_DENY_READ) {
+				return false;
+			}
+			break;
+
+		case EMU_STATE_READ_AFTER:
+			*value = (*value & reg->read_mask) | reg->read_value;
+			break;
+
+		case EMU_STATE_WRITE: {
+			if (flags & EMU_POLICY_DENY_WRITE) {
+				return false;
+			}
+
+			uint32_t write_mask = reg->write_mask;
+			uint32_t match_mask = reg->match_mask;
+			uint32_t current = 0;
+			if ((write_mask != 0xFFFFFFFF) || ((flags & EMU_POLICY_MATCH_CURRENT) && match_mask)) {
+				if ((flags & EMU_POLICY_SHADOW) && reg->shadow_valid) {
+					current = reg->shadow;
+				} else if (region->vbase) {
+					current = read32(region->vbase + offset);
+				} else {
+					EMSG("[EMU] Could not read current value of 0x%lX", (unsigned long)address);
+					return false;
+				}
+			}
+
+			uint32_t expected = (flags & EMU_POLICY_MATCH_CURRENT) ? current : reg->match_value;
+			if ((*value ^ expected) & match_mask) {
+				return false;
+			}
+			*value = (*value & write_mask) | (current & ~write_mask);
+			break;
+		}
+	}
+
+	return !reg->hook || reg->hook(region, address, state, value);
+}
+
+bool emu_policy_check(struct region *region, paddr_t address, enum emu_state state, uint32_t *value) {
+	return emu_policy_eval(region, address, state, value);
+}
+
+static bool emu_check(paddr_t address, enum emu_state state, uint32_t *value) {
+	bool allowed = true;
+
+	struct region_set *set = emu_lookup(address);
+	if (!set) {
+		return allowed;
+	}
+
+	for (int i = 0; i < set->num_regions; i++) {
+		struct region *r = set->regions[i];
+		if (r->base <= address && (address - r->base) < r->size) {
+			// Table-driven policies are evaluated inline rather than through the callback
+			if (r->policy) {
+				allowed &= emu_policy_eval(r, address, state, value);
+			} else {
+				allowed &= r->check(r, address, state, value);
+			}
+		}
+	}
+
+	return allowed;
+}
+
+bool emu_allow_all(struct region *region __unused, paddr_t address __unused, enum emu_state state __unused, uint32_t *value __unused) {
+	return true;
+}
+
+bool emu_deny_all(struct region *region __unused, paddr_t address __unused, enum emu_state state __unused, uint32_t *value __unused) {
+	return false;
+}
+
+#if defined(CFG_SECLOAK_EMU_STATS) || defined(CFG_SECLOAK_EMU_TRACE) || (CFG_SECLOAK_EMU_POLL_BUDGET > 0) || \
+    (CFG_SECLOAK_EMU_STORM_TRAPS > 0)
+static bool emu_pmu_enabled[CFG_TEE_CORE_NB_CORE];
+
+// Starts the PMU cycle counter the first time it is needed on each core
+static inline void emu_pmu_enable(void) {
+	bool *enabled = &emu_pmu_enabled[get_core_pos()];
+	if (!*enabled) {
+		write_pmcr((read_pmcr() | PMCR_E) & ~PMCR_DP);
+		write_pmcntenset(PMCNTEN_CCNT);
+		*enabled = true;
+	}
+}
+#endif
+
+#ifdef CFG_SECLOAK_EMU_STATS
+/*
+ * Per-core trap statistics, keyed by the physical address of the register in
+ * a small open-addressed table. Each core only updates its own table, so the
+ * trap path needs no locking. A reset bumps the global epoch, after which each
+ * core clears its table on its next trap (and tables from an older epoch are
+ * skipped when dumping). Cycles come from the PMU cycle counter, which is
+ * shared with the NS world, so they are only meaningful while it keeps running.
+ */
+#define EMU_STATS_SLOTS_LOG2 6
+#define EMU_STATS_SLOTS (1 << (EMU_STATS_SLOTS_LOG2))
+#define EMU_STATS_PROBES 8
+
+struct emu_stats_slot {
+	paddr_t paddr;
+	uint32_t traps;
+	uint32_t accesses;
+	uint32_t denied;
+	uint64_t cycles;
+};
+
+struct emu_stats_core {
+	struct emu_stats_slot slots[EMU_STATS_SLOTS];
+	uint32_t dropped;
+	uint32_t epoch;
+};
+
+static struct emu_stats_core emu_stats_cores[CFG_TEE_CORE_NB_CORE];
+static volatile uint32_t emu_stats_epoch = 1;
+
+static struct emu_stats_slot *emu_stats_slot(struct emu_stats_core *core, paddr_t paddr) {
+	uint32_t hash = ((paddr >> 2) * 0x9E3779B1) >> (32 - EMU_STATS_SLOTS_LOG2);
+	for (int i = 0; i < EMU_STATS_PROBES; i++) {
+		struct emu_stats_slot *slot = &core->slots[(hash + i) & (EMU_STATS_SLOTS - 1)];
+		if ((slot->traps == 0) && (slot->accesses == 0)) {
+			slot->paddr = paddr;
+			return slot;
+		} else if (slot->paddr == paddr) {
+			return slot;
+		}
+	}
+
+	core->dropped++;
+	return NULL;
+}
+
+static inline uint32_t emu_stats_begin(void) {
+	struct emu_stats_core *core = &emu_stats_cores[get_core_pos()];
+
+	uint32_t epoch = emu_stats_epoch;
+	if (core->epoch != epoch) {
+		memset(core->slots, 0, sizeof(core->slots));
+		core->dropped = 0;
+		core->epoch = epoch;
+	}
+
+	emu_pmu_enable();
+	return read_pmu_ccnt();
+}
+
+static inline void emu_stats_trap(paddr_t paddr, uint32_t start) {
+	struct emu_stats_slot *slot = emu_stats_slot(&emu_stats_cores[get_core_pos()], paddr);
+	if (slot) {
+		slot->traps++;
+		slot->cycles += read_pmu_ccnt() - start;
+	}
+}
+
+static inline void emu_stats_access(paddr_t paddr, bool allowed) {
+	struct emu_stats_slot *slot = emu_stats_slot(&emu_stats_cores[get_core_pos()], paddr);
+	if (slot) {
+		slot->accesses++;
+		slot->denied += allowed ? 0 : 1;
+	}
+}
+
+static uint32_t emu_stats_region_base(paddr_t paddr) {
+	struct region_set *set = emu_lookup(paddr);
+	for (int i = 0; set && (i < set->num_regions); i++) {
+		struct region *r = set->regions[i];
+		if (r->base <= paddr && (paddr - r->base) < r->size) {
+			return r->base;
+		}
+	}
+
+	return 0;
+}
+
+size_t emu_stats_dump(struct emu_stats_header *header, size_t max_entries, bool reset) {
+	uint32_t epoch = emu_stats_epoch;
+	size_t num_entries = 0;
+	uint32_t dropped = 0;
+
+	// Keeps the regions found through emu_stats_region_base from being freed
+	uint32_t exceptions = emu_update_begin();
+
+	for (int c = 0; c < CFG_TEE_CORE_NB_CORE; c++) {
+		struct emu_stats_core *core = &emu_stats_cores[c];
+		if (core->epoch != epoch) {
+			continue;
+		}
+		dropped += core->dropped;
+
+		for (int i = 0; i < EMU_STATS_SLOTS; i++) {
+			struct emu_stats_slot *slot = &core->slots[i];
+			if ((slot->traps == 0) && (slot->accesses == 0)) {
+				continue;
+			}
+
+			size_t e;
+			for (e = 0; e < num_entries; e++) {
+				if (header->entries[e].paddr == slot->paddr) {
+					break;
+				}
+			}
+
+			if (e == num_entries) {
+				if (num_entries == max_entries) {
+					dropped++;
+					continue;
+				}
+
+				memset(&header->entries[e], 0, sizeof(header->entries[e]));
+				header->entries[e].region_base = emu_stats_region_base(slot->paddr);
+				header->entries[e].paddr = slot->paddr;
+				num_entries++;
+			}
+
+			header->entries[e].traps += slot->traps;
+			header->entries[e].accesses += slot->accesses;
+			header->entries[e].denied += slot->denied;
+			header->entries[e].cycles += slot->cycles;
+		}
+	}
+
+	emu_update_end(exceptions);
+
+	header->num_entries = num_entries;
+	header->dropped = dropped;
+
+	if (reset) {
+		emu_stats_epoch = epoch + 1;
+	}
+
+	return num_entries;
+}
+
+uint32_t emu_stats_traps(paddr_t base, size_t size) {
+	uint32_t epoch = emu_stats_epoch;
+	uint32_t traps = 0;
+
+	for (int c = 0; c < CFG_TEE_CORE_NB_CORE; c++) {
+		struct emu_stats_core *core = &emu_stats_cores[c];
+		if (core->epoch != epoch) {
+			continue;
+		}
+
+		for (int i = 0; i < EMU_STATS_SLOTS; i++) {
+			struct emu_stats_slot *slot = &core->slots[i];
+			if ((slot->paddr >= base) && ((slot->paddr - base) < size)) {
+				traps += slot->traps;
+			}
+		}
+	}
+
+	return traps;
+}
+#else
+static inline uint32_t emu_stats_begin(void) {
+	return 0;
+}
+
+static inline void emu_stats_trap(paddr_t paddr __unused, uint32_t start __unused) {
+}
+
+static inline void emu_stats_access(paddr_t paddr __unused, bool allowed __unused) {
+}
+#endif
+
+#ifdef CFG_SECLOAK_EMU_TRACE
+/*
+ * Trace of every emulated access, written into a ring in NS shared memory that
+ * the NS world drains by advancing the tail. The head and capacity used here
+ * are kept in secure memory, so the NS world can only corrupt its own view of
+ * the ring. Records are dropped (and counted) while the ring is full.
+ */
+static unsigned int emu_trace_lock = SPINLOCK_UNLOCK;
+static struct emu_trace_ring *emu_trace_ring;
+static uint32_t emu_trace_capacity;
+static uint32_t emu_trace_head;
+
+// Reclassifies every indexed page, after a change that affects emu_fast_classify
+static void emu_fast_reclassify(void) {
+	uint32_t exceptions = emu_update_begin();
+
+	for (uint32_t s = 0; s < EMU_NUM_SECTIONS; s++) {
+		if (sections[s]) {
+			uint32_t first = s << (EMU_SECTION_SHIFT - EMU_PAGE_SHIFT);
+			emu_fast_update(first, first + EMU_PAGES_PER_SECTION - 1, false);
+		}
+	}
+
+	emu_update_end(exceptions);
+}
+
+void emu_trace_set(struct emu_trace_ring *ring, uint32_t capacity) {
+	uint32_t exceptions = cpu_spin_lock_xsave(&emu_trace_lock);
+
+	if (ring) {
+		ring->head = 0;
+		ring->tail = 0;
+		ring->capacity = capacity;
+		ring->dropped = 0;
+		emu_pmu_enable();
+	}
+
+	emu_trace_ring = ring;
+	emu_trace_capacity = capacity;
+	emu_trace_head = 0;
+
+	cpu_spin_unlock_xrestore(&emu_trace_lock, exceptions);
+
+	// Send the fast path pages through emu_handle while the ring is registered
+	emu_fast_reclassify();
+}
+
+static void emu_trace(paddr_t instr_paddr, paddr_t data_paddr, int size, uint32_t flags, uint32_t before, uint32_t after) {
+	uint32_t timestamp = read_pmu_ccnt();
+
+	cpu_spin_lock(&emu_trace_lock);
+
+	struct emu_trace_ring *ring = emu_trace_ring;
+	if (ring) {
+		uint32_t head = emu_trace_head;
+		if ((head - ring->tail) >= emu_trace_capacity) {
+			ring->dropped++;
+		} else {
+			struct emu_trace_record *record = &ring->records[head % emu_trace_capacity];
+			record->timestamp = timestamp;
+			record->core = get_core_pos();
+			record->size = size;
+			record->flags = flags;
+			record->instr_paddr = instr_paddr;
+			record->data_paddr = data_paddr;
+			record->value_before = before;
+			record->value_after = after;
+
+			// The record must be visible before the head that publishes it
+			dmb();
+			emu_trace_head = head + 1;
+			ring->head = emu_trace_head;
+		}
+	}
+
+	cpu_spin_unlock(&emu_trace_lock);
+}
+
+static inline bool emu_trace_enabled(void) {
+	return (emu_trace_ring != NULL);
+}
+#else
+static inline void emu_trace(paddr_t instr_paddr __unused, paddr_t data_paddr __unused, int size __unused,
+                             uint32_t flags __unused, uint32_t before __unused, uint32_t after __unused) {
+}
+
+static inline bool emu_trace_enabled(void) {
+	return false;
+}
+#endif
+
+static inline uint32_t read(vaddr_t addr, int size) {
+	switch(size) {
+		case 1:
+			return read8(addr);
+		case 2:
+			return read16(addr);
+		case 4:
+			return read32(addr);
+		default:
+			return 0; // Note: Will never happen
+	}
+}
+
+static inline void write(uint32_t value, vaddr_t addr, int size) {
+	switch(size) {
+		case 1:
+			write8(value, addr);
+			break;
+		case 2:
+			write16(value, addr);
+			break;
+		case 4:
+			write32(value, addr);
+			break;
+		default:
+			break; // Note: Will never happen
+	}
+}
+
+// Finds the policy entry of a register at the address with any of the flags
+static struct emu_reg_policy *emu_reg_find(paddr_t address, uint32_t flags) {
+	struct region_set *set = emu_lookup(address);
+	for (int i = 0; set && (i < set->num_regions); i++) {
+		struct region *r = set->regions[i];
+		if (r->policy && (r->base <= address) && ((address - r->base) < r->size)) {
+			struct emu_reg_policy *reg = emu_policy_find(r->policy, address - r->base);
+			if (reg && (reg->flags & flags)) {
+				return reg;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Shadows are filled from device reads on any core, while secure code (or
+ * another NS access) may change the register at the same time. Every change
+ * bumps shadow_seq under emu_shadow_lock, and a fill only lands if shadow_seq
+ * is still what it was before the device was read.
+ */
+static unsigned int emu_shadow_lock = SPINLOCK_UNLOCK;
+
+void emu_shadow_invalidate(struct emu_reg_policy *reg) {
+	dmb();
+	uint32_t exceptions = cpu_spin_lock_xsave(&emu_shadow_lock);
+	reg->shadow_seq++;
+	reg->shadow_valid = false;
+	cpu_spin_unlock_xrestore(&emu_shadow_lock, exceptions);
+}
+
+static void emu_shadow_fill(struct emu_reg_policy *reg, uint32_t seq, uint32_t value) {
+	cpu_spin_lock(&emu_shadow_lock);
+	if (reg->shadow_seq == seq) {
+		reg->shadow = value;
+		reg->shadow_valid = true;
+	}
+	cpu_spin_unlock(&emu_shadow_lock);
+}
+
+// As with a fill, a store only leaves the shadow valid if nothing changed the register since seq was sampled
+static void emu_shadow_store(struct emu_reg_policy *reg, uint32_t seq, uint32_t value, bool valid) {
+	cpu_spin_lock(&emu_shadow_lock);
+	bool unchanged = (reg->shadow_seq == seq);
+	reg->shadow_seq++;
+	reg->shadow = value;
+	reg->shadow_valid = valid && unchanged;
+	cpu_spin_unlock(&emu_shadow_lock);
+}
+
+/*
+ * Returns the policy for a register with EMU_POLICY_SHADOW or
+ * EMU_POLICY_VIRTUAL at the address, if any. Only word reads use the shadow,
+ * as the value is kept for the whole register.
+ */
+static inline struct emu_reg_policy *emu_shadow_find(paddr_t address) {
+	return emu_reg_find(address, EMU_POLICY_SHADOW | EMU_POLICY_VIRTUAL);
+}
+
+static inline uint32_t emu_sign_extend(uint32_t value, int size) {
+	if ((size == 1) && (value & 0x80)) {
+		value |= 0xFFFFFF00;
+	} else if ((size == 2) && (value & 0x8000)) {
+		value |= 0xFFFF0000;
+	}
+
+	return value;
+}
+
+#if CFG_SECLOAK_EMU_POLL_BUDGET > 0
+/*
+ * Detection of NS code spinning on a status register. Only registers marked
+ * EMU_POLICY_POLLABLE are considered, as the extra reads would lose data from
+ * FIFOs and clear-on-read registers. Each core remembers its last trapped
+ * read, and once the same instruction has read the same value from the same
+ * register EMU_POLL_THRESHOLD times in a row, the read is
+ * repeated here (with an exponential backoff) until the value changes or
+ * CFG_SECLOAK_EMU_POLL_BUDGET cycles have passed. Either way, the NS loop
+ * sees a value it could have read itself, just with fewer traps.
+ */
+#define EMU_POLL_THRESHOLD 4
+#define EMU_POLL_MIN_BACKOFF 64U
+#define EMU_POLL_MAX_BACKOFF 1024U
+#define EMU_POLL_MAX_READS 64
+
+struct emu_poll {
+	paddr_t instr_paddr;
+	paddr_t data_paddr;
+	uint32_t value;
+	uint32_t repeats;
+};
+
+static struct emu_poll emu_polls[CFG_TEE_CORE_NB_CORE];
+
+static void emu_poll(paddr_t instr_paddr, paddr_t data_paddr, vaddr_t data_vaddr, uint32_t *reg, int size, bool sign) {
+	struct emu_poll *poll = &emu_polls[get_core_pos()];
+
+	if ((poll->instr_paddr != instr_paddr) || (poll->data_paddr != data_paddr) || (poll->value != *reg)) {
+		poll->instr_paddr = instr_paddr;
+		poll->data_paddr = data_paddr;
+		poll->value = *reg;
+		poll->repeats = 0;
+		return;
+	}
+
+	if (++poll->repeats < EMU_POLL_THRESHOLD) {
+		return;
+	}
+
+	emu_pmu_enable();
+	uint32_t start = read_pmu_ccnt();
+	uint32_t backoff = EMU_POLL_MIN_BACKOFF;
+
+	// Reads and waits are bounded as well, in case the NS world stops the cycle counter. Each
+	// spin takes at least a cycle, so the spin cap never cuts a wait short while it is running.
+	for (int i = 0; i < EMU_POLL_MAX_READS; i++) {
+		uint32_t wait_start = read_pmu_ccnt();
+		for (uint32_t spin = 0; (spin < backoff) && ((read_pmu_ccnt() - wait_start) < backoff); spin++) {
+			;
+		}
+		backoff = MIN(backoff * 2, EMU_POLL_MAX_BACKOFF);
+
+		if (!emu_check(data_paddr, EMU_STATE_READ_BEFORE, NULL)) {
+			break;
+		}
+
+		uint32_t value = read(data_vaddr, size);
+		if (sign) {
+			value = emu_sign_extend(value, size);
+		}
+		emu_check(data_paddr, EMU_STATE_READ_AFTER, &value);
+
+		if (value != poll->value) {
+			*reg = value;
+			poll->value = value;
+			poll->repeats = 0;
+			break;
+		}
+
+		if ((read_pmu_ccnt() - start) >= CFG_SECLOAK_EMU_POLL_BUDGET) {
+			break;
+		}
+	}
+}
+#else
+static inline void emu_poll(paddr_t instr_paddr __unused, paddr_t data_paddr __unused, vaddr_t data_vaddr __unused,
+                            uint32_t *reg __unused, int size __unused, bool sign __unused) {
+}
+#endif
+
+/*
+ * Per-core queue of posted writes. The device order of all emulated accesses
+ * is the same as in the NS code, as the queue is flushed before any access
+ * that is not posted itself, and always before returning to the NS world.
+ */
+#define EMU_POSTED_MAX 8
+
+struct emu_posted_write {
+	vaddr_t vaddr;
+	uint32_t value;
+	int size;
+};
+
+struct emu_posted {
+	int num_writes;
+	struct emu_posted_write writes[EMU_POSTED_MAX];
+};
+
+static struct emu_posted emu_posted_queues[CFG_TEE_CORE_NB_CORE];
+
+static void emu_posted_flush(void) {
+	struct emu_posted *posted = &emu_posted_queues[get_core_pos()];
+	for (int i = 0; i < posted->num_writes; i++) {
+		write(posted->writes[i].value, posted->writes[i].vaddr, posted->writes[i].size);
+	}
+	posted->num_writes = 0;
+}
+
+static void emu_posted_queue(uint32_t value, vaddr_t vaddr, int size) {
+	struct emu_posted *posted = &emu_posted_queues[get_core_pos()];
+	if (posted->num_writes == EMU_POSTED_MAX) {
+		emu_posted_flush();
+	}
+
+	struct emu_posted_write *w = &posted->writes[posted->num_writes++];
+	w->vaddr = vaddr;
+	w->value = value;
+	w->size = size;
+}
+
+// Whether a store to the address may be posted, which needs every region there to allow it unconditionally
+static bool emu_posted_allowed(paddr_t address) {
+	bool posted = false;
+
+	struct region_set *set = emu_lookup(address);
+	for (int i = 0; set && (i < set->num_regions); i++) {
+		struct region *r = set->regions[i];
+		if ((r->base > address) || ((address - r->base) >= r->size) || (r->check == emu_allow_all)) {
+			continue;
+		}
+
+		if (!r->policy || !r->policy->posted || emu_policy_find(r->policy, address - r->base)) {
+			return false;
+		}
+		posted = true;
+	}
+
+	return posted;
+}
+
+static inline bool emu_handle_load(paddr_t instr_paddr, paddr_t data_paddr, vaddr_t data_vaddr, uint32_t *reg, int size, bool sign) {
+	emu_posted_flush();
+
+	bool allowed = emu_check(data_paddr, EMU_STATE_READ_BEFORE, NULL);
+	emu_stats_access(data_paddr, allowed);
+
+	uint32_t before = 0;
+	if (allowed) {
+		struct emu_reg_policy *policy = emu_reg_find(data_paddr, EMU_POLICY_SHADOW | EMU_POLICY_VIRTUAL | EMU_POLICY_POLLABLE);
+		struct emu_reg_policy *shadow = (policy && (policy->flags & (EMU_POLICY_SHADOW | EMU_POLICY_VIRTUAL))) ? policy : NULL;
+		if (shadow && (shadow->flags & EMU_POLICY_VIRTUAL)) {
+			*reg = 0;
+		} else if (shadow && (size == 4) && shadow->shadow_valid) {
+			*reg = shadow->shadow;
+		} else if (shadow && (size == 4)) {
+			uint32_t seq = shadow->shadow_seq;
+			dmb();
+			*reg = read(data_vaddr, size);
+			emu_shadow_fill(shadow, seq, *reg);
+		} else {
+			*reg = read(data_vaddr, size);
+		}
+		if (sign) {
+			*reg = emu_sign_extend(*reg, size);
+		}
+		before = *reg;
+		emu_check(data_paddr, EMU_STATE_READ_AFTER, reg);
+
+		// Batches are not loops
+		if (policy && (policy->flags & EMU_POLICY_POLLABLE) && instr_paddr) {
+			emu_poll(instr_paddr, data_paddr, data_vaddr, reg, size, sign);
+		}
+	} else {
+		*reg = 0;
+	}
+
+	if (emu_trace_enabled()) {
+		emu_trace(instr_paddr, data_paddr, size, allowed ? EMU_TRACE_ALLOWED : 0, before, *reg);
+	}
+
+	return allowed;
+}
+
+static inline bool emu_handle_store(paddr_t instr_paddr, paddr_t data_paddr, vaddr_t data_vaddr, uint32_t *reg, int size) {
+	// Hooks may access the device themselves, so anything queued must land first
+	bool posted = emu_posted_allowed(data_paddr);
+	if (!posted) {
+		emu_posted_flush();
+	}
+
+	uint32_t before = *reg;
+	bool allowed = emu_check(data_paddr, EMU_STATE_WRITE, reg);
+	emu_stats_access(data_paddr, allowed);
+
+	if (allowed) {
+		struct emu_reg_policy *shadow = emu_shadow_find(data_paddr);
+		uint32_t seq = shadow ? shadow->shadow_seq : 0;
+		dmb();
+		if (posted) {
+			emu_posted_queue(*reg, data_vaddr, size);
+		} else if (!shadow || !(shadow->flags & EMU_POLICY_VIRTUAL)) {
+			write(*reg, data_vaddr, size);
+		}
+
+		if (shadow && (shadow->flags & EMU_POLICY_SHADOW)) {
+			// Partial writes leave the rest of the register to be read back
+			emu_shadow_store(shadow, seq, *reg, size == 4);
+		}
+	}
+
+	if (emu_trace_enabled()) {
+		emu_trace(instr_paddr, data_paddr, size, EMU_TRACE_WRITE | (allowed ? EMU_TRACE_ALLOWED : 0), before, *reg);
+	}
+
+	return allowed;
+}
+
+/*
+ * Per-core, direct-mapped cache of decoded load/store instructions keyed by
+ * the physical address of the instruction. The NS kernel hits the same few
+ * MMIO accessors over and over, so decoding only happens on a miss. Entries
+ * also record the instruction bits and state, which are compared on lookup so
+ * that NS code being replaced at the same address cannot produce a stale
+ * decode. Changing the NS RAM mapping bumps the generation, invalidating all
+ * entries.
+ */
+#define EMU_DECODE_CACHE_SIZE_LOG2 5
+#define EMU_DECODE_CACHE_SIZE (1 << (EMU_DECODE_CACHE_SIZE_LOG2))
+
+struct emu_decoded {
+	paddr_t instr_paddr;
+	uint32_t instr;
+	uint32_t generation;
+	bool thumb;
+	struct emu_instr d;
+};
+
+struct emu_decode_cache {
+	struct emu_decoded entries[EMU_DECODE_CACHE_SIZE];
+	uint32_t hits;
+	uint32_t misses;
+};
+
+static struct emu_decode_cache emu_decode_caches[CFG_TEE_CORE_NB_CORE];
+static uint32_t emu_decode_generation = 1;
+
+static void emu_decode_invalidate(void) {
+	emu_decode_generation++;
+}
+
+static inline bool emu_instr_vaddr(paddr_t instr_paddr, vaddr_t *instr_vaddr) {
+	if ((instr_paddr < emu_instr_window.pstart) || (instr_paddr >= (emu_instr_window.pstart + emu_instr_window.size))) {
+		EMSG("[EMU] Could not translate PA->VA for instruction address 0x%lX", (unsigned long)instr_paddr);
+		return false;
+	}
+
+	*instr_vaddr = emu_instr_window.vstart + (instr_paddr - emu_instr_window.pstart);
+	return true;
+}
+
+#ifdef CFG_SECLOAK_EMU_ITLB
+/*
+ * Per-core cache of NS instruction page translations, so that the monitor does
+ * not need an ATS12NSOPR for the faulting instruction on every trap. Entries
+ * are only valid for the NS translation context (TTBR0, TTBR1 and CONTEXTIDR)
+ * they were filled under, and the whole cache is flushed when it changes. NS
+ * TLB maintenance is not visible here, so NS code remapped under the same
+ * context is caught on the next decode cache miss, which re-translates the
+ * page and replaces the entry if the PA has changed. Until then, if the old PA
+ * still holds the same instruction word, the trap is emulated (and run-ahead
+ * and PC-relative loads continue) against the old page.
+ */
+#define EMU_ITLB_SIZE_LOG2 3
+#define EMU_ITLB_SIZE (1 << (EMU_ITLB_SIZE_LOG2))
+
+struct emu_itlb_entry {
+	uint32_t vpage;
+	paddr_t ppage;
+	bool valid;
+};
+
+struct emu_itlb {
+	uint32_t ttbr0;
+	uint32_t ttbr1;
+	uint32_t contextidr;
+	struct emu_itlb_entry entries[EMU_ITLB_SIZE];
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t flushes;
+};
+
+static struct emu_itlb emu_itlbs[CFG_TEE_CORE_NB_CORE];
+
+static bool emu_itlb_lookup(struct emu_itlb *itlb, uint32_t va, paddr_t *pa) {
+	uint32_t vpage = va & ~SMALL_PAGE_MASK;
+	struct emu_itlb_entry *entry = &itlb->entries[(vpage >> SMALL_PAGE_SHIFT) & (EMU_ITLB_SIZE - 1)];
+
+	if (entry->valid && (entry->vpage == vpage)) {
+		itlb->hits++;
+	} else {
+		itlb->misses++;
+
+		write_ats12nsopr(vpage);
+		isb();
+		uint32_t par = read_par32();
+		if (par & PAR_F) {
+			return false;
+		}
+
+		entry->vpage = vpage;
+		entry->ppage = par & ~SMALL_PAGE_MASK;
+		entry->valid = true;
+	}
+
+	*pa = entry->ppage | (va & SMALL_PAGE_MASK);
+	return true;
+}
+
+// Called by the monitor with the NS translation context captured on entry
+paddr_t emu_itlb_translate(uint32_t va, uint32_t ttbr0, uint32_t ttbr1, uint32_t contextidr) {
+	struct emu_itlb *itlb = &emu_itlbs[get_core_pos()];
+
+	if ((itlb->ttbr0 != ttbr0) || (itlb->ttbr1 != ttbr1) || (itlb->contextidr != contextidr)) {
+		for (int i = 0; i < EMU_ITLB_SIZE; i++) {
+			itlb->entries[i].valid = false;
+		}
+		itlb->ttbr0 = ttbr0;
+		itlb->ttbr1 = ttbr1;
+		itlb->contextidr = contextidr;
+		itlb->flushes++;
+	}
+
+	paddr_t pa;
+	if (!emu_itlb_lookup(itlb, va, &pa)) {
+		return EMU_ITLB_INVALID;
+	}
+
+	return pa;
+}
+
+// Translates the page again, returning true (with the new PA) if the cached entry was stale
+static bool emu_itlb_revalidate(uint32_t va, paddr_t *pa) {
+	struct emu_itlb *itlb = &emu_itlbs[get_core_pos()];
+	uint32_t vpage = va & ~SMALL_PAGE_MASK;
+	struct emu_itlb_entry *entry = &itlb->entries[(vpage >> SMALL_PAGE_SHIFT) & (EMU_ITLB_SIZE - 1)];
+
+	write_ats12nsopr(vpage);
+	isb();
+	uint32_t par = read_par32();
+	if ((par & PAR_F) || !entry->valid || (entry->vpage != vpage) || (entry->ppage == (par & ~SMALL_PAGE_MASK))) {
+		return false;
+	}
+
+	entry->ppage = par & ~SMALL_PAGE_MASK;
+	itlb->flushes++;
+
+	*pa = entry->ppage | (va & SMALL_PAGE_MASK);
+	return true;
+}
+
+void emu_get_itlb_stats(uint32_t *hits, uint32_t *misses, uint32_t *flushes) {
+	*hits = 0;
+	*misses = 0;
+	*flushes = 0;
+	for (int c = 0; c < CFG_TEE_CORE_NB_CORE; c++) {
+		*hits += emu_itlbs[c].hits;
+		*misses += emu_itlbs[c].misses;
+		*flushes += emu_itlbs[c].flushes;
+	}
+}
+
+// Translates another page of the trapped instruction stream, under the context of the current trap
+static bool emu_instr_translate(uint32_t va, paddr_t *pa) {
+	return emu_itlb_lookup(&emu_itlbs[get_core_pos()], va, pa);
+}
+#else
+static bool emu_instr_translate(uint32_t va, paddr_t *pa) {
+	write_ats12nsopr(va & ~SMALL_PAGE_MASK);
+	isb();
+	uint32_t par = read_par32();
+	if (par & PAR_F) {
+		return false;
+	}
+
+	*pa = (par & ~SMALL_PAGE_MASK) | (va & SMALL_PAGE_MASK);
+	return true;
+}
+#endif
+
+static bool emu_fetch_thumb(uint32_t pc, paddr_t instr_paddr, vaddr_t instr_vaddr, uint32_t *instr) {
+	uint16_t hw1 = *((uint16_t *)instr_vaddr);
+	if (!emu_thumb_is_32bit(hw1)) {
+		*instr = hw1;
+		return true;
+	}
+
+	// The second halfword may be on the next page, which needs its own translation
+	vaddr_t hw2_vaddr = instr_vaddr + 2;
+	if (((instr_paddr + 2) & SMALL_PAGE_MASK) == 0) {
+		paddr_t hw2_paddr;
+		if (!emu_instr_translate(pc + 2, &hw2_paddr)) {
+			EMSG("[EMU] Could not translate VA->PA for instruction address 0x%X", pc + 2);
+			return false;
+		}
+		if (!emu_instr_vaddr(hw2_paddr, &hw2_vaddr)) {
+			return false;
+		}
+	}
+
+	*instr = hw1 | ((uint32_t)*((uint16_t *)hw2_vaddr) << 16);
+	return true;
+}
+
+// Sets missed unless the instruction was found in the cache
+static const struct emu_instr *emu_decode_cached(uint32_t pc, paddr_t instr_paddr, bool thumb, bool *missed) {
+	struct emu_decode_cache *cache = &emu_decode_caches[get_core_pos()];
+	struct emu_decoded *decoded = &cache->entries[(instr_paddr >> 1) & (EMU_DECODE_CACHE_SIZE - 1)];
+
+	*missed = true;
+
+	vaddr_t instr_vaddr;
+	if (!emu_instr_vaddr(instr_paddr, &instr_vaddr)) {
+		return NULL;
+	}
+
+	uint32_t instr;
+	if (thumb) {
+		if (!emu_fetch_thumb(pc, instr_paddr, instr_vaddr, &instr)) {
+			return NULL;
+		}
+	} else {
+		instr = *((uint32_t *)instr_vaddr);
+	}
+
+	if ((decoded->instr_paddr == instr_paddr) && (decoded->instr == instr) && (decoded->thumb == thumb) &&
+	    (decoded->generation == emu_decode_generation)) {
+		cache->hits++;
+		*missed = false;
+		return &decoded->d;
+	}
+
+	cache->misses++;
+	bool success = thumb ? emu_decode_thumb(instr & 0xFFFF, instr >> 16, &decoded->d) : emu_decode_arm(instr, &decoded->d);
+	if (!success) {
+		decoded->d.op = EMU_OP_UNSUPPORTED;
+	}
+
+	decoded->instr_paddr = instr_paddr;
+	decoded->instr = instr;
+	decoded->thumb = thumb;
+	decoded->generation = emu_decode_generation;
+
+	return &decoded->d;
+}
+
+void emu_get_decode_stats(uint32_t *hits, uint32_t *misses) {
+	*hits = 0;
+	*misses = 0;
+	for (int c = 0; c < CFG_TEE_CORE_NB_CORE; c++) {
+		*hits += emu_decode_caches[c].hits;
+		*misses += emu_decode_caches[c].misses;
+	}
+}
+
+// Stands in for a register that cannot be reached, so that a missed check does not take the monitor down
+static uint32_t emu_reg_scratch;
+
+/*
+ * Returns the storage for an NS register other than the PC. The SP and LR are
+ * banked by the mode the NS world was in, which are saved in mode_regs by the
+ * monitor before calling into emu_handle and restored afterwards.
+ */
+static uint32_t *emu_reg(struct sm_ctx *ctx, uint32_t index) {
+	struct sm_mode_regs *regs = &ctx->nsec.mode_regs;
+	uint32_t mode = ctx->nsec.mon_spsr & CPSR_MODE_MASK;
+
+	if (index <= 7) {
+		return &ctx->nsec.r0 + index;
+	} else if (index <= 12) {
+		// The banked FIQ r8-r12 are not saved by the monitor, which emu_regs_available checks for
+		if (mode == CPSR_MODE_FIQ) {
+			EMSG("[EMU] Unexpected access to r%u in FIQ mode", index);
+			return &emu_reg_scratch;
+		}
+		return &ctx->nsec.r8 + (index - 8);
+	}
+
+	bool is_sp = (index == 13);
+	switch (mode) {
+		case CPSR_MODE_USR:
+		case CPSR_MODE_SYS:
+			return is_sp ? &regs->usr_sp : &regs->usr_lr;
+		case CPSR_MODE_IRQ:
+			return is_sp ? &regs->irq_sp : &regs->irq_lr;
+		case CPSR_MODE_FIQ:
+			return is_sp ? &regs->fiq_sp : &regs->fiq_lr;
+		case CPSR_MODE_SVC:
+			return is_sp ? &regs->svc_sp : &regs->svc_lr;
+		case CPSR_MODE_ABT:
+			return is_sp ? &regs->abt_sp : &regs->abt_lr;
+		case CPSR_MODE_UND:
+			return is_sp ? &regs->und_sp : &regs->und_lr;
+		default:
+			EMSG("[EMU] Unexpected NS mode 0x%X", mode);
+			return &emu_reg_scratch;
+	}
+}
+
+/*
+ * Whether every register the instruction uses can be reached in the current NS
+ * mode. Registers are over-approximated from the decoded fields.
+ */
+static bool emu_regs_available(struct sm_ctx *ctx, const struct emu_instr *d) {
+	uint32_t regs = 1 << d->rn;
+	switch (d->op) {
+		case EMU_OP_LOAD_DUAL:
+		case EMU_OP_STORE_DUAL:
+			regs |= 1 << d->rt2;
+			// Fall through
+		case EMU_OP_LOAD:
+		case EMU_OP_STORE:
+			regs |= 1 << d->rt;
+			break;
+		case EMU_OP_LOAD_MULTIPLE:
+		case EMU_OP_STORE_MULTIPLE:
+			regs |= d->reglist;
+			break;
+		case EMU_OP_DATA:
+			regs |= 1 << d->rd;
+			break;
+		default:
+			break;
+	}
+	if (d->reg_offset) {
+		regs |= (1 << d->rm) | (d->reg_shift ? (1 << d->rs) : 0);
+	}
+
+	switch (ctx->nsec.mon_spsr & CPSR_MODE_MASK) {
+		case CPSR_MODE_FIQ:
+			return !(regs & (0x1F << 8));
+		case CPSR_MODE_USR:
+		case CPSR_MODE_SYS:
+		case CPSR_MODE_IRQ:
+		case CPSR_MODE_SVC:
+		case CPSR_MODE_ABT:
+		case CPSR_MODE_UND:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static inline uint32_t emu_reg_read(struct sm_ctx *ctx, uint32_t index, uint32_t pc, bool thumb) {
+	if (index == 15) {
+		return pc + (thumb ? 4 : 8);
+	}
+	return *emu_reg(ctx, index);
+}
+
+static inline void emu_reg_write(struct sm_ctx *ctx, uint32_t index, uint32_t value, uint32_t *next_pc) {
+	if (index != 15) {
+		*emu_reg(ctx, index) = value;
+		return;
+	}
+
+	// Loads to the PC interwork, based on the low bit of the value
+	if (value & 1) {
+		ctx->nsec.mon_spsr |= CPSR_T;
+		*next_pc = value & ~1;
+	} else {
+		ctx->nsec.mon_spsr &= ~CPSR_T;
+		*next_pc = value & ~3;
+	}
+}
+
+#define EMU_SPSR_N (1U << 31)
+#define EMU_SPSR_Z (1U << 30)
+#define EMU_SPSR_C (1U << 29)
+#define EMU_SPSR_V (1U << 28)
+
+static bool emu_cond_passed(uint32_t cond, uint32_t spsr) {
+	bool n = (spsr & EMU_SPSR_N);
+	bool z = (spsr & EMU_SPSR_Z);
+	bool c = (spsr & EMU_SPSR_C);
+	bool v = (spsr & EMU_SPSR_V);
+
+	bool result;
+	switch (cond >> 1) {
+		case 0:
+			result = z;
+			break;
+		case 1:
+			result = c;
+			break;
+		case 2:
+			result = n;
+			break;
+		case 3:
+			result = v;
+			break;
+		case 4:
+			result = c && !z;
+			break;
+		case 5:
+			result = (n == v);
+			break;
+		case 6:
+			result = !z && (n == v);
+			break;
+		default:
+			return true;
+	}
+
+	return (cond & 1) ? !result : result;
+}
+
+static uint32_t emu_shift_c(uint32_t value, uint32_t type, uint32_t amount, uint32_t carry_in, uint32_t *carry_out) {
+	*carry_out = carry_in;
+	if (amount == 0) {
+		return value;
+	}
+
+	switch (type) {
+		case EMU_SHIFT_LSL:
+			if (amount > 32) {
+				*carry_out = 0;
+				return 0;
+			}
+			*carry_out = (value >> (32 - amount)) & 1;
+			return (amount == 32) ? 0 : (value << amount);
+		case EMU_SHIFT_LSR:
+			if (amount > 32) {
+				*carry_out = 0;
+				return 0;
+			}
+			*carry_out = (value >> (amount - 1)) & 1;
+			return (amount == 32) ? 0 : (value >> amount);
+		case EMU_SHIFT_ASR:
+			if (amount >= 32) {
+				*carry_out = value >> 31;
+				return (value & (1U << 31)) ? 0xFFFFFFFF : 0;
+			}
+			*carry_out = (value >> (amount - 1)) & 1;
+			return (uint32_t)((int32_t)value >> amount);
+		case EMU_SHIFT_ROR:
+			amount &= 31;
+			if (amount != 0) {
+				value = (value >> amount) | (value << (32 - amount));
+			}
+			*carry_out = value >> 31;
+			return value;
+		default:
+			return value; // Note: Will never happen
+	}
+}
+
+// Computes the second operand of a data-processing instruction, or the offset of a load/store
+static uint32_t emu_operand(struct sm_ctx *ctx, const struct emu_instr *d, uint32_t pc, bool thumb, uint32_t *carry_out) {
+	uint32_t carry = (ctx->nsec.mon_spsr & EMU_SPSR_C) ? 1 : 0;
+
+	if (!d->reg_offset) {
+		*carry_out = d->imm_carry ? (d->imm >> 31) : carry;
+		return d->imm;
+	}
+
+	uint32_t rm = emu_reg_read(ctx, d->rm, pc, thumb);
+	if (d->reg_shift) {
+		return emu_shift_c(rm, d->shift_type, emu_reg_read(ctx, d->rs, pc, thumb) & 0xFF, carry, carry_out);
+	}
+
+	uint32_t amount = d->shift_amount;
+	if (amount == 0) {
+		if (d->shift_type == EMU_SHIFT_ROR) {
+			// RRX, shifting in the carry flag
+			*carry_out = rm & 1;
+			return (carry << 31) | (rm >> 1);
+		} else if (d->shift_type != EMU_SHIFT_LSL) {
+			amount = 32;
+		}
+	}
+
+	return emu_shift_c(rm, d->shift_type, amount, carry, carry_out);
+}
+
+static inline uint32_t emu_add_with_carry(uint32_t x, uint32_t y, uint32_t carry_in, uint32_t *carry_out, uint32_t *overflow) {
+	uint64_t sum = (uint64_t)x + y + carry_in;
+	uint32_t result = (uint32_t)sum;
+
+	*carry_out = (uint32_t)(sum >> 32);
+	*overflow = (~(x ^ y) & (x ^ result)) >> 31;
+	return result;
+}
+
+static void emu_execute_data(struct sm_ctx *ctx, const struct emu_instr *d, uint32_t pc, bool thumb) {
+	uint32_t spsr = ctx->nsec.mon_spsr;
+	uint32_t carry = (spsr & EMU_SPSR_C) ? 1 : 0;
+	uint32_t overflow = (spsr & EMU_SPSR_V) ? 1 : 0;
+
+	uint32_t operand = emu_operand(ctx, d, pc, thumb, &carry);
+	uint32_t n = emu_reg_read(ctx, d->rn, pc, thumb);
+	uint32_t flag_c = (spsr & EMU_SPSR_C) ? 1 : 0;
+
+	uint32_t result;
+	switch (d->alu) {
+		case EMU_ALU_AND:
+		case EMU_ALU_TST:
+			result = n & operand;
+			break;
+		case EMU_ALU_EOR:
+		case EMU_ALU_TEQ:
+			result = n ^ operand;
+			break;
+		case EMU_ALU_SUB:
+		case EMU_ALU_CMP:
+			result = emu_add_with_carry(n, ~operand, 1, &carry, &overflow);
+			break;
+		case EMU_ALU_RSB:
+			result = emu_add_with_carry(~n, operand, 1, &carry, &overflow);
+			break;
+		case EMU_ALU_ADD:
+		case EMU_ALU_CMN:
+			result = emu_add_with_carry(n, operand, 0, &carry, &overflow);
+			break;
+		case EMU_ALU_ADC:
+			result = emu_add_with_carry(n, operand, flag_c, &carry, &overflow);
+			break;
+		case EMU_ALU_SBC:
+			result = emu_add_with_carry(n, ~operand, flag_c, &carry, &overflow);
+			break;
+		case EMU_ALU_RSC:
+			result = emu_add_with_carry(~n, operand, flag_c, &carry, &overflow);
+			break;
+		case EMU_ALU_ORR:
+			result = n | operand;
+			break;
+		case EMU_ALU_MOV:
+			result = operand;
+			break;
+		case EMU_ALU_BIC:
+			result = n & ~operand;
+			break;
+		case EMU_ALU_MVN:
+			result = ~operand;
+			break;
+		case EMU_ALU_ORN:
+			result = n | ~operand;
+			break;
+		case EMU_ALU_MOVT:
+			result = (*emu_reg(ctx, d->rd) & 0xFFFF) | (operand << 16);
+			break;
+		default:
+			return; // Note: Will never happen
+	}
+
+	// The compares only update the flags
+	if ((d->alu < EMU_ALU_TST) || (d->alu > EMU_ALU_CMN)) {
+		*emu_reg(ctx, d->rd) = result;
+	}
+
+	if (d->setflags) {
+		spsr &= ~(EMU_SPSR_N | EMU_SPSR_Z | EMU_SPSR_C | EMU_SPSR_V);
+		spsr |= (result & EMU_SPSR_N);
+		spsr |= (result == 0) ? EMU_SPSR_Z : 0;
+		spsr |= carry ? EMU_SPSR_C : 0;
+		spsr |= overflow ? EMU_SPSR_V : 0;
+		ctx->nsec.mon_spsr = spsr;
+	}
+}
+
+// Returns the secure VA of [pa, pa + size) from a region covering it, or 0 if there is none
+static vaddr_t emu_region_vaddr(paddr_t pa, int size) {
+	struct region_set *set = emu_lookup(pa);
+	for (int i = 0; set && (i < set->num_regions); i++) {
+		struct region *r = set->regions[i];
+		if (r->vbase && (r->base <= pa) && ((pa - r->base) < r->size) && ((r->size - (pa - r->base)) >= (uint32_t)size)) {
+			return r->vbase + (pa - r->base);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Translates an NS virtual address accessed by the instruction into the secure
+ * mapping of its physical address. Only the faulting page has been translated
+ * by the monitor, so the caller ensures all accesses fall within it.
+ */
+static bool emu_data_addr(uint32_t address, paddr_t fault_paddr, paddr_t *data_paddr, vaddr_t *data_vaddr) {
+	paddr_t pa = (fault_paddr & ~SMALL_PAGE_MASK) | (address & SMALL_PAGE_MASK);
+	*data_paddr = pa;
+
+	// Any region covering the address has the VA of its base cached
+	*data_vaddr = emu_region_vaddr(pa, 1);
+	if (*data_vaddr) {
+		return true;
+	}
+
+	*data_vaddr = emu_data_vaddr(pa, 1);
+	if (!*data_vaddr) {
+		EMSG("[EMU] Could not translate PA->VA for data address 0x%lX", (unsigned long)pa);
+		return false;
+	}
+
+	return true;
+}
+
+static bool emu_access(paddr_t instr_paddr, uint32_t address, paddr_t fault_paddr, bool load, int size, bool sign, uint32_t *value) {
+	paddr_t data_paddr;
+	vaddr_t data_vaddr;
+	if (!emu_data_addr(address, fault_paddr, &data_paddr, &data_vaddr)) {
+		return false;
+	}
+
+	if (load) {
+		emu_handle_load(instr_paddr, data_paddr, data_vaddr, value, size, sign);
+	} else {
+		emu_handle_store(instr_paddr, data_paddr, data_vaddr, value, size);
+	}
+	return true;
+}
+
+static inline bool emu_in_fault_page(uint32_t address, uint32_t length, uint32_t fault_address, bool quiet) {
+	if (((address & ~SMALL_PAGE_MASK) == (fault_address & ~SMALL_PAGE_MASK)) &&
+	    (((address + length - 1) & ~SMALL_PAGE_MASK) == (fault_address & ~SMALL_PAGE_MASK))) {
+		return true;
+	}
+
+	if (!quiet) {
+		EMSG("[EMU] Access to 0x%X crosses the faulting page at 0x%X", address, fault_address);
+	}
+	return false;
+}
+
+static inline uint32_t emu_it_advance(uint32_t spsr) {
+	uint32_t it = ((spsr >> 25) & 0x3) | ((spsr >> 8) & 0xFC);
+	if (it == 0) {
+		return spsr;
+	}
+
+	it = ((it & 0x7) == 0) ? 0 : ((it & 0xE0) | ((it << 1) & 0x1F));
+	spsr &= ~CPSR_IT_MASK;
+	return spsr | ((it & 0x3) << 25) | ((it & 0xFC) << 8);
+}
+
+/*
+ * Executes a decoded instruction, then moves the NS return address past it
+ * (or to the target of a load into the PC). Loads/stores must stay within the
+ * faulting page. Nothing is changed when this returns false, unless one of the
+ * accesses could not be translated.
+ */
+static bool emu_execute(struct sm_ctx *ctx, const struct emu_instr *d, uint32_t pc, paddr_t instr_paddr, bool thumb,
+                        uint32_t fault_address, paddr_t fault_paddr, bool run_ahead) {
+	uint32_t next_pc = pc + d->length;
+	uint32_t base = emu_reg_read(ctx, d->rn, pc, thumb);
+	if (thumb && (d->rn == 15)) {
+		base &= ~3;
+	}
+
+	switch (d->op) {
+		case EMU_OP_LOAD:
+		case EMU_OP_STORE:
+		case EMU_OP_LOAD_DUAL:
+		case EMU_OP_STORE_DUAL: {
+			uint32_t carry;
+			uint32_t offset = emu_operand(ctx, d, pc, thumb, &carry);
+			uint32_t offset_address = d->add ? (base + offset) : (base - offset);
+			uint32_t address = d->index ? offset_address : base;
+
+			bool load = (d->op == EMU_OP_LOAD) || (d->op == EMU_OP_LOAD_DUAL);
+			bool dual = (d->op == EMU_OP_LOAD_DUAL) || (d->op == EMU_OP_STORE_DUAL);
+			if (!emu_in_fault_page(address, dual ? 8 : d->size, fault_address, run_ahead)) {
+				return false;
+			}
+
+			uint32_t value = 0;
+			uint32_t value2 = 0;
+			if (!load) {
+				value = emu_reg_read(ctx, d->rt, pc, thumb);
+				value2 = dual ? emu_reg_read(ctx, d->rt2, pc, thumb) : 0;
+			}
+
+			if (!emu_access(instr_paddr, address, fault_paddr, load, d->size, d->sign, &value)) {
+				return false;
+			}
+			if (dual && !emu_access(instr_paddr, address + 4, fault_paddr, load, 4, false, &value2)) {
+				return false;
+			}
+
+			if (d->wback) {
+				emu_reg_write(ctx, d->rn, offset_address, &next_pc);
+			}
+			if (load) {
+				emu_reg_write(ctx, d->rt, value, &next_pc);
+				if (dual) {
+					emu_reg_write(ctx, d->rt2, value2, &next_pc);
+				}
+			}
+			break;
+		}
+
+		case EMU_OP_LOAD_MULTIPLE:
+		case EMU_OP_STORE_MULTIPLE: {
+			uint32_t length = 4 * __builtin_popcount(d->reglist);
+			uint32_t address = d->add ? base : (base - length);
+			if (d->add == d->index) {
+				address += 4;
+			}
+			uint32_t wback_address = d->add ? (base + length) : (base - length);
+
+			if (!emu_in_fault_page(address, length, fault_address, run_ahead)) {
+				return false;
+			}
+
+			bool load = (d->op == EMU_OP_LOAD_MULTIPLE);
+			uint32_t values[16];
+			for (int i = 0; i < 16; i++) {
+				if (d->reglist & (1 << i)) {
+					values[i] = load ? 0 : emu_reg_read(ctx, i, pc, thumb);
+					if (!emu_access(instr_paddr, address, fault_paddr, load, 4, false, &values[i])) {
+						return false;
+					}
+					address += 4;
+				}
+			}
+
+			// Registers loaded from memory take priority over the written back base
+			if (d->wback) {
+				emu_reg_write(ctx, d->rn, wback_address, &next_pc);
+			}
+			if (load) {
+				for (int i = 0; i < 16; i++) {
+					if (d->reglist & (1 << i)) {
+						emu_reg_write(ctx, i, values[i], &next_pc);
+					}
+				}
+			}
+			break;
+		}
+
+		case EMU_OP_DATA:
+			emu_execute_data(ctx, d, pc, thumb);
+			break;
+
+		case EMU_OP_BARRIER:
+			emu_posted_flush();
+			dsb();
+			break;
+
+		case EMU_OP_NOP:
+			break;
+
+		default:
+			return false;
 	}
 
-	r->base = base;
-	r->size = size;
-	r->check = check;
-	SLIST_INSERT_HEAD(&regions, r, entry);
+	if (thumb) {
+		ctx->nsec.mon_spsr = emu_it_advance(ctx->nsec.mon_spsr);
+	}
+	ctx->nsec.mon_lr = next_pc;
 
-	return 0;
+	return true;
 }
 
-void emu_remove_region(paddr_t base, uint32_t size, emu_check_t check) {
-	struct region *r;
-	SLIST_FOREACH(r, &regions, entry) {
-		if (r->base == base && r->size == size && r->check == check) {
-			SLIST_REMOVE(&regions, r, region, entry);
-			free(r);
-			return;
+#if CFG_SECLOAK_EMU_RUN_AHEAD > 0
+/*
+ * NS drivers tend to issue bursts of accesses to the same peripheral, so after
+ * the faulting instruction, keep emulating the ones that follow it rather than
+ * taking a trap for each. This stops at anything other than a load/store,
+ * data-processing, barrier or NOP instruction, at loads/stores outside of the
+ * faulting page, at loads into the PC, on leaving the page of the faulting
+ * instruction (the only one translated), on entering an IT block and after
+ * CFG_SECLOAK_EMU_RUN_AHEAD instructions.
+ */
+static void emu_run_ahead(struct sm_ctx *ctx, uint32_t fault_pc, paddr_t instr_paddr, uint32_t fault_address, paddr_t fault_paddr) {
+	for (int i = 0; i < CFG_SECLOAK_EMU_RUN_AHEAD; i++) {
+		uint32_t pc = ctx->nsec.mon_lr;
+		uint32_t spsr = ctx->nsec.mon_spsr;
+		bool thumb = (spsr & CPSR_T);
+
+		if ((pc & ~SMALL_PAGE_MASK) != (fault_pc & ~SMALL_PAGE_MASK)) {
+			break;
+		}
+		if (thumb && ((spsr & CPSR_IT_MASK) || ((pc & SMALL_PAGE_MASK) == (SMALL_PAGE_MASK - 1)))) {
+			break;
+		}
+
+		paddr_t paddr = (instr_paddr & ~SMALL_PAGE_MASK) | (pc & SMALL_PAGE_MASK);
+		bool missed;
+		const struct emu_instr *d = emu_decode_cached(pc, paddr, thumb, &missed);
+		if (!d || (d->op == EMU_OP_UNSUPPORTED) || !emu_regs_available(ctx, d)) {
+			break;
+		}
+
+		if (!emu_cond_passed(d->cond, spsr)) {
+			ctx->nsec.mon_lr = pc + d->length;
+			continue;
+		}
+
+		if (!emu_execute(ctx, d, pc, paddr, thumb, fault_address, fault_paddr, true) || (ctx->nsec.mon_lr != (pc + d->length))) {
+			break;
 		}
 	}
 }
+#endif
 
-static bool emu_check(paddr_t address, enum emu_state state, uint32_t *value) {
-	bool allowed = true;
+#define EMU_DFSR_EXT_ABORT 0x008
+#define EMU_DFSR_WNR       (1 << 11)
+#define EMU_CPSR_J         (1 << 24)
 
-	struct region *r;
-	SLIST_FOREACH(r, &regions, entry) {
-		if (r->base <= address && (r->base + r->size) >= address) {
-			allowed &= r->check(r, address, state, value);
-		}
+/*
+ * Enters the NS abort mode as if the access at pc had taken a synchronous
+ * external abort. The fault status and address registers, SCTLR and VBAR are
+ * banked, so the NS copies are only reachable with SCR.NS set.
+ */
+static void emu_inject_abort(struct sm_ctx *ctx, uint32_t pc, uint32_t fault_address, bool is_store) {
+	uint32_t scr = read_scr();
+	write_scr(scr | SCR_NS);
+	isb();
+
+	uint32_t sctlr = read_sctlr();
+	uint32_t vbar = read_vbar();
+	write_dfsr(EMU_DFSR_EXT_ABORT | (is_store ? EMU_DFSR_WNR : 0));
+	write_dfar(fault_address);
+
+	write_scr(scr);
+	isb();
+
+	uint32_t spsr = ctx->nsec.mon_spsr;
+	ctx->nsec.mode_regs.abt_spsr = spsr;
+	ctx->nsec.mode_regs.abt_lr = pc + 8;
+
+	spsr &= ~(CPSR_MODE_MASK | CPSR_T | CPSR_IT_MASK | EMU_CPSR_J | ARM32_CPSR_E);
+	spsr |= CPSR_MODE_ABT | CPSR_I | CPSR_A;
+	if (sctlr & SCTLR_TE) {
+		spsr |= CPSR_T;
+	}
+	if (sctlr & SCTLR_EE) {
+		spsr |= ARM32_CPSR_E;
 	}
 
-	return allowed;
+	ctx->nsec.mon_spsr = spsr;
+	ctx->nsec.mon_lr = ((sctlr & SCTLR_V) ? 0xFFFF0000 : vbar) + 0x10;
 }
 
-bool emu_allow_all(struct region *region __unused, paddr_t address __unused, enum emu_state state __unused, uint32_t *value __unused) {
-	return true;
-}
+#if CFG_SECLOAK_EMU_STORM_TRAPS > 0
+/*
+ * Detection of NS code hammering a device that has been disabled. Each core
+ * counts its traps to the deny-all region it last trapped on, and once
+ * CFG_SECLOAK_EMU_STORM_TRAPS of them land within CFG_SECLOAK_EMU_STORM_WINDOW
+ * cycles, the rest of the window is a storm. With CFG_SECLOAK_EMU_STORM_ABORT,
+ * instead of returning 0 to the hot loop yet again, each trap is then turned
+ * into an external abort in the NS world, which tells its driver that the
+ * device is gone (and usually crashes it). Storms and aborts are kept per
+ * region, and can be read through OPTEE_SMC_CLOAK_EMU_STORMS.
+ */
+struct emu_storm {
+	paddr_t region_base;
+	uint32_t window_start;
+	uint32_t last_trap;
+	uint32_t traps;
+	bool storming;
+};
 
-bool emu_deny_all(struct region *region __unused, paddr_t address __unused, enum emu_state state __unused, uint32_t *value __unused) {
-	return false;
+static struct emu_storm emu_storms[CFG_TEE_CORE_NB_CORE];
+
+static struct region *emu_storm_region(paddr_t address) {
+	struct region_set *set = emu_lookup(address);
+	for (int i = 0; set && (i < set->num_regions); i++) {
+		struct region *r = set->regions[i];
+		if ((r->check == emu_deny_all) && (r->base <= address) && ((address - r->base) < r->size)) {
+			return r;
+		}
+	}
+
+	return NULL;
 }
 
-static inline uint32_t read(vaddr_t addr, int size) {
-	switch(size) {
-		case 1:
-			return read8(addr);
-		case 2:
-			return read16(addr);
-		case 4:
-			return read32(addr);
-		default:
-			return 0; // Note: Will never happen
+static bool emu_storm_check(paddr_t data_paddr) {
+	struct region *r = emu_storm_region(data_paddr);
+	if (!r) {
+		return false;
+	}
+
+	struct emu_storm *storm = &emu_storms[get_core_pos()];
+	emu_pmu_enable();
+	uint32_t now = read_pmu_ccnt();
+
+	/*
+	 * There is no generic timer on this core, and the NS world can stop (or
+	 * reset) the cycle counter. A trap takes far longer than a cycle, so a
+	 * counter that has not moved since the last trap ends the window as well,
+	 * and a stopped counter can only turn detection off, never hold a storm.
+	 */
+	bool stopped = (now == storm->last_trap);
+	storm->last_trap = now;
+
+	if ((storm->region_base != r->base) || stopped || ((now - storm->window_start) >= CFG_SECLOAK_EMU_STORM_WINDOW)) {
+		storm->region_base = r->base;
+		storm->window_start = now;
+		storm->traps = 0;
+		storm->storming = false;
+	}
+
+	if (++storm->traps < CFG_SECLOAK_EMU_STORM_TRAPS) {
+		return false;
 	}
+
+	if (!storm->storming) {
+		storm->storming = true;
+		r->storms++;
+		EMSG("[EMU] Trap storm on disabled region 0x%lX-0x%lX", r->base, r->base + r->size - 1);
+	}
+
+#ifdef CFG_SECLOAK_EMU_STORM_ABORT
+	r->storm_aborts++;
+	return true;
+#else
+	return false;
+#endif
 }
 
-static inline void write(uint32_t value, vaddr_t addr, int size) {
-	switch(size) {
-		case 1:
-			write8(value, addr);
-			break;
-		case 2:
-			write16(value, addr);
-			break;
-		case 4:
-			write32(value, addr);
-			break;
-		default:
-			break; // Note: Will never happen
+size_t emu_storm_dump(struct emu_storm_entry *entries, size_t max_entries) {
+	size_t num_entries = 0;
+	uint32_t exceptions = emu_update_begin();
+
+	struct region *r;
+	SLIST_FOREACH(r, &regions, entry) {
+		if ((r->storms == 0) || (num_entries == max_entries)) {
+			continue;
+		}
+
+		struct emu_storm_entry entry = {
+			.region_base = r->base,
+			.size = r->size,
+			.storms = r->storms,
+			.aborts = r->storm_aborts,
+		};
+		entries[num_entries++] = entry;
 	}
+
+	emu_update_end(exceptions);
+	return num_entries;
 }
+#else
+static inline bool emu_storm_check(paddr_t data_paddr __unused) {
+	return false;
+}
+#endif
 
-static inline void emu_handle_load(paddr_t data_paddr, vaddr_t data_vaddr, uint32_t *reg, int size, bool sign) {
-	if (emu_check(data_paddr, EMU_STATE_READ_BEFORE, NULL)) {
-		*reg = read(data_vaddr, size);
-		if (sign) {
-			if (size == 1) {
-				if ((*reg) & 0x80) {
-					*reg |= 0xFFFFFF00;
-				}
-			} else if (size == 2) {
-				if ((*reg) & 0x8000) {
-					*reg |= 0xFFFF0000;
+/*
+ * Applies a batch of register accesses on behalf of the NS world, through the
+ * same policies as trapped accesses. Unlike traps, which can only reach
+ * CSU-protected devices, the batch can name any address, so only addresses
+ * covered by an emulated region are accepted. Each descriptor is copied out of
+ * shared memory before it is checked, and its result is written back in place.
+ */
+size_t emu_batch(struct emu_batch_op *ops, size_t num_ops) {
+	emu_read_begin();
+
+	for (size_t i = 0; i < num_ops; i++) {
+		struct emu_batch_op op = ops[i];
+		uint8_t result = EMU_BATCH_INVALID;
+
+		vaddr_t vaddr = 0;
+		if (((op.size == 1) || (op.size == 2) || (op.size == 4)) && ((op.address & (op.size - 1)) == 0)) {
+			vaddr = emu_region_vaddr(op.address, op.size);
+		}
+
+		if (vaddr) {
+			bool allowed;
+			switch (op.op) {
+				case EMU_BATCH_READ:
+					allowed = emu_handle_load(0, op.address, vaddr, &op.value, op.size, false);
+					break;
+
+				case EMU_BATCH_WRITE:
+					allowed = emu_handle_store(0, op.address, vaddr, &op.value, op.size);
+					break;
+
+				case EMU_BATCH_MODIFY: {
+					// Modifies the value as the NS world sees it, and writes it back through the policy
+					uint32_t current;
+					allowed = emu_handle_load(0, op.address, vaddr, &current, op.size, false);
+					if (allowed) {
+						op.value = (current & ~op.mask) | (op.value & op.mask);
+						allowed = emu_handle_store(0, op.address, vaddr, &op.value, op.size);
+					}
+					break;
 				}
+
+				default:
+					allowed = false;
+					vaddr = 0;
+					break;
+			}
+
+			if (vaddr) {
+				result = allowed ? EMU_BATCH_OK : EMU_BATCH_DENIED;
 			}
 		}
-		emu_check(data_paddr, EMU_STATE_READ_AFTER, reg);
-	} else {
-		*reg = 0;
-	}
-}
 
-static inline void emu_handle_store(paddr_t data_paddr, vaddr_t data_vaddr, uint32_t *reg, int size) {
-	if (emu_check(data_paddr, EMU_STATE_WRITE, reg)) {
-		write(*reg, data_vaddr, size);
+		ops[i].value = op.value;
+		ops[i].result = result;
 	}
+
+	emu_posted_flush();
+	emu_read_end();
+
+	return num_ops;
 }
 
 void emu_handle(struct sm_ctx *ctx, unsigned long status, unsigned long data_paddr, unsigned long instr_paddr) {
@@ -131,80 +2309,423 @@ void emu_handle(struct sm_ctx *ctx, unsigned long status, unsigned long data_pad
 		return;
 	}
 
-	if ((data_paddr < emu_data_pstart) || (data_paddr >= (emu_data_pstart + emu_data_size))) {
-		EMSG("[EMU] Could not translate PA->VA for data address 0x%lX", data_paddr);
+	// Data aborts return to 8 bytes past the instruction, and the monitor has already taken 4 off
+	uint32_t pc = ctx->nsec.mon_lr - 4;
+	bool thumb = (ctx->nsec.mon_spsr & CPSR_T);
+
+#ifdef CFG_SECLOAK_EMU_ITLB
+	// As with an untranslatable data address, the instruction is skipped
+	if (instr_paddr == EMU_ITLB_INVALID) {
+		EMSG("[EMU] Could not translate VA->PA for instruction address 0x%X", pc);
 		return;
 	}
-	vaddr_t data_vaddr = emu_data_vstart + (data_paddr - emu_data_pstart);
+#endif
 
-	if ((instr_paddr < emu_instr_pstart) || (instr_paddr >= (emu_instr_pstart + emu_instr_size))) {
-		EMSG("[EMU] Could not translate PA->VA for instruction address 0x%lX", instr_paddr);
+	bool missed;
+	const struct emu_instr *d = emu_decode_cached(pc, instr_paddr, thumb, &missed);
+#ifdef CFG_SECLOAK_EMU_ITLB
+	// A miss may come from NS code remapped under the same translation context, so check the ITLB entry
+	paddr_t fresh_paddr;
+	if (missed && emu_itlb_revalidate(pc, &fresh_paddr)) {
+		instr_paddr = fresh_paddr;
+		d = emu_decode_cached(pc, instr_paddr, thumb, &missed);
+	}
+#endif
+	if (!d) {
 		return;
 	}
-	vaddr_t instr_vaddr = emu_instr_vstart + (instr_paddr - emu_instr_pstart);
 
-	uint32_t instr = *((uint32_t *)instr_vaddr);
-
-	uint32_t instr_rt = (instr >> 12) & 0xF;
-	uint32_t *reg;
-	if (instr_rt <= 7) {
-		reg = &ctx->nsec.r0 + instr_rt;
-	} else if (instr_rt <= 12) {
-			reg = &ctx->nsec.r8 + (instr_rt - 8);
-	} else if (instr_rt == 14) {
-			reg = &ctx->nsec.lr;
-	} else {
-		EMSG("[EMU] Unexpected instruction with Rt of %u", instr_rt);
-		panic();
+	// Encodings the emulator cannot handle (e.g. LDREX/STREX or LDM with the S bit) get the abort they would have taken
+	uint32_t fault_address = read_dfar();
+	bool is_store = (d->op == EMU_OP_STORE) || (d->op == EMU_OP_STORE_DUAL) || (d->op == EMU_OP_STORE_MULTIPLE);
+	if ((d->op > EMU_OP_STORE_MULTIPLE) || !emu_regs_available(ctx, d)) {
+		EMSG("[EMU] Unsupported %s instruction 0x%X at 0x%X in mode 0x%X", thumb ? "Thumb" : "ARM",
+		     container_of(d, struct emu_decoded, d)->instr, pc, (unsigned int)(ctx->nsec.mon_spsr & CPSR_MODE_MASK));
+		emu_inject_abort(ctx, pc, fault_address, is_store);
 		return;
 	}
 
-	uint32_t instr_type = (instr >> 25) & 0x7;
-	if ((instr_type & 0x6) == 0x2) {
-		int size = (instr & (1 << 22)) ? 1 : 4;
-		if (instr & (1 << 20)) {
-			emu_handle_load(data_paddr, data_vaddr, reg, size, false);
-		} else {
-			emu_handle_store(data_paddr, data_vaddr, reg, size);
-		}
-	} else if (instr_type == 0) {
-		int size = (instr & (1 << 5)) ? 2 : 1;
-		if (instr & (1 << 20)) {
-			bool sign = (instr & (1 << 6));
-			emu_handle_load(data_paddr, data_vaddr, reg, size, sign);
-		} else {
-			emu_handle_store(data_paddr, data_vaddr, reg, size);
-		}
+	uint32_t stats_start = emu_stats_begin();
+	emu_read_begin();
+
+	// As with an untranslatable data address before, the instruction is skipped
+	if (emu_storm_check(data_paddr)) {
+		emu_inject_abort(ctx, pc, fault_address, is_store);
+	} else if (!emu_execute(ctx, d, pc, instr_paddr, thumb, fault_address, data_paddr, false)) {
+		ctx->nsec.mon_lr = pc + d->length;
 	} else {
-		EMSG("[EMU] Unexpected instruction with type %u", instr_type);
-		panic();
+#if CFG_SECLOAK_EMU_RUN_AHEAD > 0
+		emu_run_ahead(ctx, pc, instr_paddr, fault_address, data_paddr);
+#endif
 	}
+
+	emu_posted_flush();
+	emu_read_end();
+	emu_stats_trap(data_paddr, stats_start);
 }
 
 static TEE_Result emulation_init(void) {
-  const struct tee_mmap_region *map;
+  const struct tee_mmap_region *map = NULL;
 
-	map = core_mmu_find_map_by_type_and_pa(MEM_AREA_IO_SEC, 0x01000000);
-	if (map == NULL) {
+	while ((map = core_mmu_find_next_map_by_type(MEM_AREA_IO_SEC, map)) != NULL) {
+		emu_add_data_window(map->pa, map->va, map->size);
+	}
+
+	if (!emu_data_window_find(0x01000000)) {
 		EMSG("[EMU] Could not get MEM_AREA_IO_SEC mapping");
 		panic();
 	}
 
-	emu_data_pstart = map->pa;
-	emu_data_vstart = map->va;
-	emu_data_size = map->size;
-
 	map = core_mmu_find_map_by_type(MEM_AREA_RAM_NSEC);
 	if (map == NULL) {
 		EMSG("[EMU] Could not get MEM_AREA_RAM_NSEC mapping");
 		panic();
 	}
 
-	emu_instr_pstart = map->pa;
-	emu_instr_vstart = map->va;
-	emu_instr_size = map->size;
+	emu_instr_window.pstart = map->pa;
+	emu_instr_window.vstart = map->va;
+	emu_instr_window.size = map->size;
+	emu_decode_invalidate();
 
 	return 0;
 }
 driver_init_late(emulation_init);
 
+#ifdef CFG_SECLOAK_EMU_BENCH
+#define EMU_BENCH_BASE 0xF0000000
+#define EMU_BENCH_ITERATIONS 1024
+
+#define EMU_BENCH_POLICY_REGS 8
+#define EMU_BENCH_POLICY_MASK 0x0000FF00
+
+// Register offset used by the single register benchmarks
+#define EMU_BENCH_SHADOW_OFFSET 0x80
+
+#define EMU_BENCH_BATCH_OPS 16
+
+// Where the replayed NS code pretends to run, and to have EMU_BENCH_BASE mapped
+#define EMU_BENCH_REPLAY_PC 0xC0008000
+#define EMU_BENCH_REPLAY_VA 0xC1000000
+
+/*
+ * Secure memory standing in for a device page at EMU_BENCH_BASE, so that the
+ * benchmarks never touch a live device or change the protection of its CSL
+ */
+static uint8_t emu_bench_page[SMALL_PAGE_SIZE] __aligned(SMALL_PAGE_SIZE);
+
+// Points the region added at EMU_BENCH_BASE with the given check and policy at emu_bench_page
+static void emu_bench_map(emu_check_t check, struct emu_policy *policy) {
+	struct region_set *set = emu_lookup(EMU_BENCH_BASE);
+	for (int i = 0; set && (i < set->num_regions); i++) {
+		struct region *r = set->regions[i];
+		if ((r->base == EMU_BENCH_BASE) && (r->check == check) && (r->policy == policy)) {
+			r->vbase = (vaddr_t)emu_bench_page;
+		}
+	}
+}
+
+static uint32_t emu_bench_time(paddr_t address, enum emu_state state) {
+	uint32_t value = 0;
+
+	uint32_t start = read_pmu_ccnt();
+	for (int i = 0; i < EMU_BENCH_ITERATIONS; i++) {
+		emu_check(address, state, &value);
+	}
+
+	return (read_pmu_ccnt() - start) / EMU_BENCH_ITERATIONS;
+}
+
+// Callback with the same behavior as the policy table in emulation_bench_policy
+static bool emu_bench_check(struct region *region, paddr_t address, enum emu_state state, uint32_t *value) {
+	paddr_t offset = address - region->base;
+	for (paddr_t reg = 0; reg < (EMU_BENCH_POLICY_REGS * 4); reg += 4) {
+		if (offset == reg) {
+			if (state == EMU_STATE_READ_AFTER) {
+				*value &= ~EMU_BENCH_POLICY_MASK;
+			}
+			break;
+		}
+	}
+
+	return true;
+}
+
+// Compares a callback against the equivalent policy table, for the last register
+static void emulation_bench_policy(void) {
+	static struct emu_reg_policy regs[EMU_BENCH_POLICY_REGS];
+	static struct emu_policy policy = { .num_regs = EMU_BENCH_POLICY_REGS, .regs = regs };
+
+	for (int i = 0; i < EMU_BENCH_POLICY_REGS; i++) {
+		regs[i].offset = i * 4;
+		regs[i].read_mask = ~EMU_BENCH_POLICY_MASK;
+		regs[i].write_mask = 0xFFFFFFFF;
+	}
+
+	paddr_t address = EMU_BENCH_BASE + ((EMU_BENCH_POLICY_REGS - 1) * 4);
+
+	if (emu_add_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, emu_bench_check) == 0) {
+		IMSG("[EMU] Benchmark: callback policy, %u cycles per check", emu_bench_time(address, EMU_STATE_READ_AFTER));
+		emu_remove_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, emu_bench_check);
+	}
+
+	if (emu_add_policy_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, &policy) == 0) {
+		IMSG("[EMU] Benchmark: table policy, %u cycles per check", emu_bench_time(address, EMU_STATE_READ_AFTER));
+		emu_remove_policy_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, &policy);
+	}
+}
+
+// Compares a trapped read from the device against one served from a shadow register
+static void emulation_bench_shadow(void) {
+	static struct emu_reg_policy regs[1];
+	static struct emu_policy policy = { .num_regs = 1, .regs = regs };
+
+	paddr_t address = EMU_BENCH_BASE + EMU_BENCH_SHADOW_OFFSET;
+	vaddr_t vaddr = (vaddr_t)&emu_bench_page[EMU_BENCH_SHADOW_OFFSET];
+
+	regs[0].offset = EMU_BENCH_SHADOW_OFFSET;
+	regs[0].read_mask = 0xFFFFFFFF;
+	regs[0].write_mask = 0xFFFFFFFF;
+
+	if (emu_add_policy_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, &policy) != 0) {
+		return;
+	}
+
+	uint32_t cycles[2];
+	for (int shadowed = 0; shadowed < 2; shadowed++) {
+		regs[0].flags = shadowed ? EMU_POLICY_SHADOW : 0;
+		regs[0].shadow_valid = false;
+
+		uint32_t value;
+		uint32_t start = read_pmu_ccnt();
+		for (int i = 0; i < EMU_BENCH_ITERATIONS; i++) {
+			emu_handle_load(0, address, vaddr, &value, 4, false);
+		}
+		cycles[shadowed] = (read_pmu_ccnt() - start) / EMU_BENCH_ITERATIONS;
+	}
+
+	emu_remove_policy_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, &policy);
+
+	IMSG("[EMU] Benchmark: trapped read, %u cycles from the device, %u cycles from a shadow register", cycles[0], cycles[1]);
+}
+
+// Compares reads through a batch against the same reads through the trap path's handler
+static void emulation_bench_batch(void) {
+	static struct emu_batch_op ops[EMU_BENCH_BATCH_OPS];
+
+	paddr_t address = EMU_BENCH_BASE + EMU_BENCH_SHADOW_OFFSET;
+	vaddr_t vaddr = (vaddr_t)&emu_bench_page[EMU_BENCH_SHADOW_OFFSET];
+	if (emu_add_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, emu_allow_all) != 0) {
+		return;
+	}
+	emu_bench_map(emu_allow_all, NULL);
+
+	uint32_t value;
+	uint32_t start = read_pmu_ccnt();
+	for (int i = 0; i < EMU_BENCH_BATCH_OPS; i++) {
+		emu_handle_load(0, address, vaddr, &value, 4, false);
+	}
+	uint32_t handler_cycles = (read_pmu_ccnt() - start) / EMU_BENCH_BATCH_OPS;
+
+	for (int i = 0; i < EMU_BENCH_BATCH_OPS; i++) {
+		ops[i].address = address;
+		ops[i].size = 4;
+		ops[i].op = EMU_BATCH_READ;
+	}
+
+	start = read_pmu_ccnt();
+	emu_batch(ops, EMU_BENCH_BATCH_OPS);
+	uint32_t batch_cycles = (read_pmu_ccnt() - start) / EMU_BENCH_BATCH_OPS;
+
+	emu_remove_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, emu_allow_all);
+
+	// A trap also pays for the exception entry and exit, and the decode, once per access
+	IMSG("[EMU] Benchmark: %u cycles per access through a batch of %d, %u cycles per access in the trap handler",
+	     batch_cycles, EMU_BENCH_BATCH_OPS, handler_cycles);
+}
+
+/*
+ * Compares stores to an unlisted register issued one by one against the same
+ * stores posted. The register is a word of secure memory standing in for a
+ * device at EMU_BENCH_BASE, so no live device is written.
+ */
+static void emulation_bench_posted(void) {
+	static struct emu_reg_policy regs[1];
+	static struct emu_policy policy = { .num_regs = 1, .regs = regs };
+	static uint32_t scratch;
+
+	paddr_t address = EMU_BENCH_BASE;
+	vaddr_t vaddr = (vaddr_t)&scratch;
+
+	// Only the register after the stored one is listed, so the stores can be posted
+	regs[0].offset = 4;
+	regs[0].read_mask = 0xFFFFFFFF;
+	regs[0].write_mask = 0xFFFFFFFF;
+
+	if (emu_add_policy_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, &policy) != 0) {
+		return;
+	}
+
+	uint32_t cycles[2];
+	emu_read_begin();
+	for (int posted = 0; posted < 2; posted++) {
+		policy.posted = posted;
+
+		uint32_t start = read_pmu_ccnt();
+		for (int i = 0; i < EMU_BENCH_BATCH_OPS; i++) {
+			uint32_t value = i;
+			emu_handle_store(0, address, vaddr, &value, 4);
+		}
+		emu_posted_flush();
+		cycles[posted] = (read_pmu_ccnt() - start) / EMU_BENCH_BATCH_OPS;
+	}
+	emu_read_end();
+
+	emu_remove_policy_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, &policy);
+
+	IMSG("[EMU] Benchmark: %u cycles per store issued directly, %u cycles per store posted", cycles[0], cycles[1]);
+}
+
+// Compares an uncached instruction translation against a translation cache hit
+static void emulation_bench_itlb(void) {
+#ifdef CFG_SECLOAK_EMU_ITLB
+	uint32_t va = (uint32_t)emulation_bench_itlb;
+	uint32_t ttbr0 = read_ttbr0();
+	uint32_t ttbr1 = read_ttbr1();
+	uint32_t contextidr = read_contextidr();
+
+	uint32_t start = read_pmu_ccnt();
+	for (int i = 0; i < EMU_BENCH_ITERATIONS; i++) {
+		write_ats12nsopr(va & ~SMALL_PAGE_MASK);
+		isb();
+		read_par32();
+	}
+	uint32_t ats_cycles = (read_pmu_ccnt() - start) / EMU_BENCH_ITERATIONS;
+
+	emu_itlb_translate(va, ttbr0, ttbr1, contextidr);
+	start = read_pmu_ccnt();
+	for (int i = 0; i < EMU_BENCH_ITERATIONS; i++) {
+		emu_itlb_translate(va, ttbr0, ttbr1, contextidr);
+	}
+	uint32_t hit_cycles = (read_pmu_ccnt() - start) / EMU_BENCH_ITERATIONS;
+
+	IMSG("[EMU] Benchmark: instruction translation, %u cycles with ATS12NSOPR, %u cycles on a cache hit", ats_cycles, hit_cycles);
+#endif
+}
+
+// MMIO read accessors as the NS kernel emits them, all relative to a register at EMU_BENCH_BASE
+static const uint32_t emu_bench_replay_instrs[] = {
+	0xE5910000, // ldr r0, [r1]
+	0xE1D120B4, // ldrh r2, [r1, #4]
+	0xE5D13008, // ldrb r3, [r1, #8]
+	0xE891000C, // ldm r1, {r2, r3}
+};
+
+/*
+ * Replays a synthetic trap sequence through the stages of the slow path with a
+ * fake NS context, under a policy table that leaves every value unchanged. The
+ * execute stage includes its own lookup and policy check, as well as the
+ * access to the stand-in page, but not the exception entry and exit or the
+ * translations.
+ */
+static void emulation_bench_replay(void) {
+	static struct emu_reg_policy regs[EMU_BENCH_POLICY_REGS];
+	static struct emu_policy policy = { .num_regs = EMU_BENCH_POLICY_REGS, .regs = regs };
+	static struct sm_ctx ctx;
+	const int num_instrs = sizeof(emu_bench_replay_instrs) / sizeof(emu_bench_replay_instrs[0]);
+
+	paddr_t address = EMU_BENCH_BASE + EMU_BENCH_SHADOW_OFFSET;
+	uint32_t fault_address = EMU_BENCH_REPLAY_VA | (address & SMALL_PAGE_MASK);
+
+	for (int i = 0; i < EMU_BENCH_POLICY_REGS; i++) {
+		regs[i].offset = EMU_BENCH_SHADOW_OFFSET + (i * 4);
+		regs[i].flags = 0;
+		regs[i].read_mask = 0xFFFFFFFF;
+		regs[i].write_mask = 0xFFFFFFFF;
+	}
+
+	if (emu_add_policy_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, &policy) != 0) {
+		return;
+	}
+	emu_bench_map(emu_policy_check, &policy);
+
+	uint32_t decode_cycles = 0;
+	uint32_t lookup_cycles = 0;
+	uint32_t policy_cycles = 0;
+	uint32_t execute_cycles = 0;
+	struct emu_instr d;
+
+	emu_read_begin();
+	for (int i = 0; i < EMU_BENCH_ITERATIONS; i++) {
+		for (int n = 0; n < num_instrs; n++) {
+			uint32_t value = 0;
+			ctx.nsec.r1 = fault_address;
+
+			uint32_t start = read_pmu_ccnt();
+			emu_decode_arm(emu_bench_replay_instrs[n], &d);
+			uint32_t decoded = read_pmu_ccnt();
+			emu_region_vaddr(address, d.size);
+			uint32_t looked_up = read_pmu_ccnt();
+			emu_check(address, EMU_STATE_READ_BEFORE, &value);
+			uint32_t checked = read_pmu_ccnt();
+			emu_execute(&ctx, &d, EMU_BENCH_REPLAY_PC, 0, false, fault_address, address, false);
+			uint32_t executed = read_pmu_ccnt();
+
+			decode_cycles += decoded - start;
+			lookup_cycles += looked_up - decoded;
+			policy_cycles += checked - looked_up;
+			execute_cycles += executed - checked;
+		}
+	}
+	emu_read_end();
+
+	emu_remove_policy_region(EMU_BENCH_BASE, 1 << EMU_PAGE_SHIFT, &policy);
+
+	uint32_t traps = EMU_BENCH_ITERATIONS * num_instrs;
+	IMSG("[EMU] Benchmark: replay of %d accessors, %u decode, %u lookup, %u policy, %u execute cycles per trap",
+	     num_instrs, decode_cycles / traps, lookup_cycles / traps, policy_cycles / traps, execute_cycles / traps);
+}
+
+// Measures the region lookup cost of emu_check as the number of regions grows
+static TEE_Result emulation_bench(void) {
+	static const int counts[] = { 1, 16, 64, 256 };
+
+	write_pmcr((read_pmcr() | PMCR_E) & ~PMCR_DP);
+	write_pmcntenset(PMCNTEN_CCNT);
+
+	int added = 0;
+	for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		while (added < counts[c]) {
+			if (emu_add_region(EMU_BENCH_BASE + (added << EMU_PAGE_SHIFT), 1 << EMU_PAGE_SHIFT, emu_allow_all) != 0) {
+				EMSG("[EMU] Benchmark could not add region %d", added);
+				goto out;
+			}
+			added++;
+		}
+
+		// The oldest region was the last one visited by the previous list walk
+		uint32_t start = read_pmu_ccnt();
+		for (int i = 0; i < EMU_BENCH_ITERATIONS; i++) {
+			emu_check(EMU_BENCH_BASE, EMU_STATE_READ_BEFORE, NULL);
+		}
+		uint32_t cycles = read_pmu_ccnt() - start;
+
+		IMSG("[EMU] Benchmark: %d regions, %u cycles per check", added, cycles / EMU_BENCH_ITERATIONS);
+	}
+
+out:
+	while (added > 0) {
+		added--;
+		emu_remove_region(EMU_BENCH_BASE + (added << EMU_PAGE_SHIFT), 1 << EMU_PAGE_SHIFT, emu_allow_all);
+	}
+
+	emulation_bench_policy();
+	emulation_bench_itlb();
+	emulation_bench_shadow();
+	emulation_bench_batch();
+	emulation_bench_posted();
+	emulation_bench_replay();
+
+	return 0;
+}
+driver_init_late(emulation_bench);
+#endif
@@ -15,6 +15,7 @@
 #include <mm/core_memprot.h>
 #include <mm/core_mmu.h>
 #include <sm/optee_smc.h>
+#include <secloak/emulation.h>
 #include <secloak/image_headers.h>
 #include <secloak/settings.h>
 #include <string.h>
@@ -256,23 +257,24 @@ static void cloak_entry_set(struct thread_smc_args *args) {
 			IMSG("\tClass '%s' = %s", classes[c].name, classes[c].allow ? "Enabled" : "Disabled");
 		}
 		
-		// TODO: Clean this up. Right now, it is possible for a device to belong to
-		// two classes. If one of those classes is enabled, and comes after the
-		// one that is disabled, then the device will remain enabled.
-		// To fix this, we set all classes as enabled and then only call
-		// dt_enable_class when we want to disable the class.
+		// A device belonging to several classes is disabled if any of them is
+		uint32_t class_mask = 0;
+		uint32_t enabled_mask = 0;
 		for (unsigned int c = 0; c < sizeof(classes) / sizeof(classes[0]); c++) {
-			dt_enable_class(classes[c].name, true);
-		}
-		for (unsigned int c = 0; c < sizeof(classes) / sizeof(classes[0]); c++) {
-			if (!classes[c].allow) {
-				dt_enable_class(classes[c].name, false);
+			int id = dt_class_lookup(classes[c].name);
+			if (id >= 0) {
+				class_mask |= (1U << id);
+				enabled_mask |= (classes[c].allow ? (1U << id) : 0);
 			}
 		}
-
-		cloak_prev_settings = args->a1;
-
-		fb_clear(&fb, 0x00, 0xFF, 0x00);
+		if (dt_apply_classes(class_mask, enabled_mask)) {
+			cloak_prev_settings = args->a1;
+			fb_clear(&fb, 0x00, 0xFF, 0x00);
+		} else {
+			EMSG("[SeCloak] Could not apply the settings");
+			error = OPTEE_SMC_RETURN_ENOMEM;
+			fb_clear(&fb, 0xFF, 0x00, 0x00);
+		}
 	} else {
 		DMSG("[SeCloak] Confirmed 'Deny'");
 		fb_clear(&fb, 0xFF, 0x00, 0x00);
@@ -305,12 +307,113 @@ err_lock:
 	args->a0 = error;
 }
 
+static void cloak_entry_emu_stats(struct thread_smc_args *args) {
+	paddr_t buffer_paddr = args->a1;
+	size_t buffer_size = args->a2;
+
+	if ((buffer_paddr & 7) || (buffer_size < sizeof(struct emu_stats_header)) || !core_pbuf_is(CORE_MEM_NSEC_SHM, buffer_paddr, buffer_size)) {
+		EMSG("[SeCloak] Invalid statistics buffer (paddr 0x%lX, size 0x%X)", buffer_paddr, buffer_size);
+		args->a0 = OPTEE_SMC_RETURN_EBADADDR;
+		return;
+	}
+
+	struct emu_stats_header *header = phys_to_virt(buffer_paddr, MEM_AREA_NSEC_SHM);
+	if (!header) {
+		args->a0 = OPTEE_SMC_RETURN_EBADADDR;
+		return;
+	}
+
+	size_t max_entries = (buffer_size - sizeof(struct emu_stats_header)) / sizeof(struct emu_stats_entry);
+	args->a1 = emu_stats_dump(header, max_entries, args->a3 != 0);
+	args->a0 = OPTEE_SMC_RETURN_OK;
+}
+
+static void cloak_entry_emu_trace(struct thread_smc_args *args) {
+	paddr_t ring_paddr = args->a1;
+	size_t ring_size = args->a2;
+
+	if (ring_size == 0) {
+		emu_trace_set(NULL, 0);
+		args->a1 = 0;
+		args->a0 = OPTEE_SMC_RETURN_OK;
+		return;
+	}
+
+	if ((ring_paddr & 7) || (ring_size < sizeof(struct emu_trace_ring) + sizeof(struct emu_trace_record)) ||
+	    !core_pbuf_is(CORE_MEM_NSEC_SHM, ring_paddr, ring_size)) {
+		EMSG("[SeCloak] Invalid trace ring (paddr 0x%lX, size 0x%X)", ring_paddr, ring_size);
+		args->a0 = OPTEE_SMC_RETURN_EBADADDR;
+		return;
+	}
+
+	struct emu_trace_ring *ring = phys_to_virt(ring_paddr, MEM_AREA_NSEC_SHM);
+	if (!ring) {
+		args->a0 = OPTEE_SMC_RETURN_EBADADDR;
+		return;
+	}
+
+	uint32_t capacity = (ring_size - sizeof(struct emu_trace_ring)) / sizeof(struct emu_trace_record);
+	emu_trace_set(ring, capacity);
+	args->a1 = capacity;
+	args->a0 = OPTEE_SMC_RETURN_OK;
+}
+
+static void cloak_entry_emu_batch(struct thread_smc_args *args) {
+	paddr_t ops_paddr = args->a1;
+	size_t num_ops = args->a2;
+	size_t ops_size = num_ops * sizeof(struct emu_batch_op);
+
+	if ((ops_paddr & 3) || (num_ops == 0) || (num_ops > OPTEE_SMC_CLOAK_EMU_BATCH_MAX) ||
+	    !core_pbuf_is(CORE_MEM_NSEC_SHM, ops_paddr, ops_size)) {
+		EMSG("[SeCloak] Invalid batch (paddr 0x%lX, count %u)", ops_paddr, num_ops);
+		args->a0 = OPTEE_SMC_RETURN_EBADADDR;
+		return;
+	}
+
+	struct emu_batch_op *ops = phys_to_virt(ops_paddr, MEM_AREA_NSEC_SHM);
+	if (!ops) {
+		args->a0 = OPTEE_SMC_RETURN_EBADADDR;
+		return;
+	}
+
+	args->a1 = emu_batch(ops, num_ops);
+	args->a0 = OPTEE_SMC_RETURN_OK;
+}
+
+static void cloak_entry_emu_storms(struct thread_smc_args *args) {
+	paddr_t buffer_paddr = args->a1;
+	size_t buffer_size = args->a2;
+
+	if ((buffer_paddr & 3) || (buffer_size < sizeof(struct emu_storm_entry)) || !core_pbuf_is(CORE_MEM_NSEC_SHM, buffer_paddr, buffer_size)) {
+		EMSG("[SeCloak] Invalid storm buffer (paddr 0x%lX, size 0x%X)", buffer_paddr, buffer_size);
+		args->a0 = OPTEE_SMC_RETURN_EBADADDR;
+		return;
+	}
+
+	struct emu_storm_entry *entries = phys_to_virt(buffer_paddr, MEM_AREA_NSEC_SHM);
+	if (!entries) {
+		args->a0 = OPTEE_SMC_RETURN_EBADADDR;
+		return;
+	}
+
+	args->a1 = emu_storm_dump(entries, buffer_size / sizeof(struct emu_storm_entry));
+	args->a0 = OPTEE_SMC_RETURN_OK;
+}
+
 void cloak_entry(struct thread_smc_args *smc_args)
 {
 	if (smc_args->a0 == OPTEE_SMC_CLOAK_SET) {
 		cloak_entry_set(smc_args);
-	} else if (smc_args->a1 == OPTEE_SMC_CLOAK_GET) {
+	} else if (smc_args->a0 == OPTEE_SMC_CLOAK_GET) {
 		cloak_entry_get(smc_args);
+	} else if (smc_args->a0 == OPTEE_SMC_CLOAK_EMU_STATS) {
+		cloak_entry_emu_stats(smc_args);
+	} else if (smc_args->a0 == OPTEE_SMC_CLOAK_EMU_TRACE) {
+		cloak_entry_emu_trace(smc_args);
+	} else if (smc_args->a0 == OPTEE_SMC_CLOAK_EMU_BATCH) {
+		cloak_entry_emu_batch(smc_args);
+	} else if (smc_args->a0 == OPTEE_SMC_CLOAK_EMU_STORMS) {
+		cloak_entry_emu_storms(smc_args);
 	} else {
 		smc_args->a0 = OPTEE_SMC_RETURN_EBADCMD;
 	}
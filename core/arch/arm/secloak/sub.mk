@@ -1,2 +1,3 @@
 srcs-y += entry.c
 srcs-y += emulation.c
+srcs-y += decode.c
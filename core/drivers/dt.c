@@ -11,6 +11,7 @@
 #include <mm/core_memprot.h>
 #include <mm/core_mmu.h>
 #include <secloak/emulation.h>
+#include <util.h>
 
 static inline uint32_t hash_32(uint32_t value, unsigned int bits) {
 	return (value * 0x61C88647) >> (32 - bits);
@@ -65,9 +66,160 @@ static inline struct device* device_next(int *b, struct device *dev) {
 #define device_for_each_parent_excl(start, dev) \
 	for (dev = start->parent; dev != NULL; dev = dev->parent)
 
+// The device and its parents up to (and including) the one that protects it
+#define device_for_each_guard(start, dev) \
+	for (dev = start; dev != NULL; dev = (dev == start->protector) ? NULL : dev->parent)
+
+static bool device_array_add(struct device ***array, int *num, struct device *dev) {
+	struct device **devices = realloc(*array, sizeof(*devices) * (*num + 1));
+	if (!devices) {
+		EMSG("[DT] \tOut of memory");
+		return false;
+	}
+
+	devices[(*num)++] = dev;
+	*array = devices;
+	return true;
+}
+
+/*
+ * Device classes, interned in the order their names are first seen. Each one
+ * keeps an array of its member devices, so toggling a class only visits them.
+ */
+struct dt_class {
+	const char *name;
+	struct device **devices;
+	int num_devices;
+};
+
+static struct dt_class g_classes[DT_MAX_CLASSES];
+static int g_num_classes;
+
+int dt_class_lookup(const char *name) {
+	for (int id = 0; id < g_num_classes; id++) {
+		if (strcmp(g_classes[id].name, name) == 0) {
+			return id;
+		}
+	}
+
+	return -1;
+}
+
+static int dt_class_intern(const char *name) {
+	int id = dt_class_lookup(name);
+	if (id >= 0) {
+		return id;
+	}
+
+	if (g_num_classes == DT_MAX_CLASSES) {
+		EMSG("[DT] \tToo many classes, ignoring '%s'", name);
+		return -1;
+	}
+
+	id = g_num_classes++;
+	g_classes[id].name = name;
+	return id;
+}
+
+static bool dt_class_add_device(int id, struct device *dev) {
+	struct dt_class *class = &g_classes[id];
+	if (!device_array_add(&class->devices, &class->num_devices, dev)) {
+		return false;
+	}
+
+	dev->class_mask |= (1U << id);
+	return true;
+}
+
+// Devices protected through each CSL, which may be shared by several of them
+struct dt_csl_users {
+	struct device **devices;
+	int num_devices;
+};
+
+static struct dt_csl_users g_csl_users[CSU_MAX_CSL];
+
+struct device **dt_csl_devices(int csl, int *num_devices) {
+	if ((csl < 0) || (csl >= CSU_MAX_CSL)) {
+		*num_devices = 0;
+		return NULL;
+	}
+
+	*num_devices = g_csl_users[csl].num_devices;
+	return g_csl_users[csl].devices;
+}
+
+/*
+ * Nodes with a phandle, indexed in one pass over the tree when probing starts,
+ * as fdt_node_offset_by_phandle scans the whole tree on every call. Each entry
+ * also caches the device for the node once it has been created.
+ */
+#define PHANDLE_TABLE_SIZE_LOG2 7
+#define PHANDLE_TABLE_SIZE (1 << (PHANDLE_TABLE_SIZE_LOG2))
+
+struct phandle_entry {
+	uint32_t phandle;
+	int node;
+	struct device *dev;
+	SLIST_ENTRY(phandle_entry) entry;
+};
+
+struct phandle_bucket {
+	SLIST_HEAD(, phandle_entry) entries;
+};
+
+static struct phandle_bucket g_phandle_table[PHANDLE_TABLE_SIZE];
+
+static struct phandle_entry *phandle_lookup(uint32_t phandle) {
+	struct phandle_bucket *bucket = &g_phandle_table[hash_32(phandle, PHANDLE_TABLE_SIZE_LOG2)];
+	struct phandle_entry *e;
+
+	SLIST_FOREACH(e, &bucket->entries, entry) {
+		if (e->phandle == phandle) {
+			break;
+		}
+	}
+
+	return e;
+}
+
+static void phandle_index(const void *fdt) {
+	for (int b = 0; b < PHANDLE_TABLE_SIZE; b++) {
+		SLIST_INIT(&g_phandle_table[b].entries);
+	}
+
+	for (int node = fdt_next_node(fdt, -1, NULL); node >= 0; node = fdt_next_node(fdt, node, NULL)) {
+		uint32_t phandle = fdt_get_phandle(fdt, node);
+		if ((phandle == 0) || (phandle == (uint32_t)-1)) {
+			continue;
+		}
+
+		struct phandle_entry *e = malloc(sizeof(*e));
+		if (!e) {
+			EMSG("[DT] Out of memory");
+			panic();
+		}
+
+		e->phandle = phandle;
+		e->node = node;
+		e->dev = NULL;
+		SLIST_INSERT_HEAD(&g_phandle_table[hash_32(phandle, PHANDLE_TABLE_SIZE_LOG2)].entries, e, entry);
+	}
+}
+
+static int phandle_node(uint32_t phandle) {
+	struct phandle_entry *e = phandle_lookup(phandle);
+	return e ? e->node : -FDT_ERR_NOTFOUND;
+}
+
 static void device_insert(struct device *dev) {
 	struct device_bucket *bucket = &g_device_table.buckets[hash_32(dev->node, DEVICE_TABLE_SIZE_LOG2)];
 	SLIST_INSERT_HEAD(&bucket->entries, dev, entry);
+
+	struct phandle_entry *e = dev->phandle ? phandle_lookup(dev->phandle) : NULL;
+	if (e) {
+		e->dev = dev;
+	}
 }
 
 static struct device* dt_probe_device(void *fdt, int offset, struct device *parent, bool probe_children);
@@ -139,7 +291,7 @@ static bool dt_parse_interrupts_ext(void *fdt, struct device *dev) {
 	if (irqs) {
 		int index = 0;
 		while (index < (irqs_length / 4)) {
-			int chip_offset = fdt_node_offset_by_phandle(fdt, fdt32_to_cpu(irqs[index]));
+			int chip_offset = phandle_node(fdt32_to_cpu(irqs[index]));
 			if (chip_offset < 0) {
 				EMSG("[DT] \tDevice '%s' has invalid extended IRQ phandle", dev->name);
 				return false;
@@ -207,7 +359,7 @@ static bool dt_parse_interrupts(void *fdt, struct device *dev) {
 			int irq_parent_phandle_length;
 			const fdt32_t *irq_parent_phandle = fdt_getprop(fdt, parent->node, "interrupt-parent", &irq_parent_phandle_length);
 			if (irq_parent_phandle && (irq_parent_phandle_length == 4)) {
-				int irq_parent = fdt_node_offset_by_phandle(fdt, fdt32_to_cpu(*irq_parent_phandle));
+				int irq_parent = phandle_node(fdt32_to_cpu(*irq_parent_phandle));
 				if (irq_parent < 0) {
 					EMSG("[DT] \tParent '%s' has invalid IRQ parent phandle", fdt_get_name(fdt, irq_parent, NULL));
 					return false;
@@ -273,6 +425,12 @@ static bool dt_parse_sp_csu(void *fdt, struct device *dev) {
 
 		for (int c = 0; c < dev->num_csu; c++) {
 			dev->csu[c] = fdt32_to_cpu(sp_csu[c]);
+
+			if (dev->resource_type == RESOURCE_MEM) {
+				for (int r = 0; r < dev->num_resources; r++) {
+					csu_add_csl_range(dev->csu[c], dev->resources[r].address[0], dev->resources[r].size[0]);
+				}
+			}
 		}
 	}
 
@@ -283,15 +441,13 @@ static bool dt_parse_sp_class(void *fdt, struct device *dev) {
 	int sp_class_length;
 	const char *sp_class = fdt_getprop(fdt, dev->node, "sp-class", &sp_class_length);
 	if (sp_class) {
-		dev->num_classes = fdt_stringlist_count(fdt, dev->node, "sp-class");
-		dev->classes = malloc(sizeof(*dev->classes) * dev->num_classes);
-		if (!dev->classes) {
-			EMSG("[DT] \tOut of memory");
-			return false;
-		}
-
-		for (int c = 0; c < dev->num_classes; c++) {
-			dev->classes[c] = sp_class;
+		int num_classes = fdt_stringlist_count(fdt, dev->node, "sp-class");
+		for (int c = 0; c < num_classes; c++) {
+			// Classes beyond DT_MAX_CLASSES are left out, rather than failing the probe
+			int id = dt_class_intern(sp_class);
+			if ((id >= 0) && !(dev->class_mask & (1U << id)) && !dt_class_add_device(id, dev)) {
+				return false;
+			}
 			sp_class += strlen(sp_class) + 1;
 		}
 	}
@@ -376,19 +532,20 @@ static struct device* dt_probe_device(void *fdt, int offset, struct device *pare
 	return dev;
 }
 
-struct device *dt_lookup_device(const void *fdt, fdt32_t phandle) {
-	int offset = fdt_node_offset_by_phandle(fdt, fdt32_to_cpu(phandle));
-	return device_lookup(offset);
-}
+struct device *dt_lookup_device(const void *fdt __unused, fdt32_t phandle) {
+	struct phandle_entry *e = phandle_lookup(fdt32_to_cpu(phandle));
+	if (!e) {
+		return NULL;
+	}
 
-bool dt_enable_device(struct device *dev, bool enable) {
-	bool can_protect = ((dev->num_csu > 0) && (dev->resource_type == RESOURCE_MEM));
+	return e->dev ? e->dev : device_lookup(e->node);
+}
 
-	if (dev->enabled == enable) {
-		goto out;
-	}
+static inline bool device_can_protect(struct device *dev) {
+	return ((dev->num_csu > 0) && (dev->resource_type == RESOURCE_MEM));
+}
 
-	// Disabling IRQs for the device
+static void device_set_irqs(struct device *dev, bool enable) {
 	for(int i = 0; i < dev->num_irqs; i++) {
 		if (enable) {
 			irq_unsecure(&dev->irqs[i].desc);
@@ -398,25 +555,42 @@ bool dt_enable_device(struct device *dev, bool enable) {
 			irq_secure(&dev->irqs[i].desc);
 		}
 	}
+}
+
+static void device_set_regions(struct device *dev, bool enable) {
+	for (int r = 0; r < dev->num_resources; r++) {
+		if (enable) {
+			emu_remove_region(dev->resources[r].address[0], dev->resources[r].size[0], emu_deny_all);
+		} else {
+			emu_add_region(dev->resources[r].address[0], dev->resources[r].size[0], emu_deny_all);
+		}
+	}
+}
+
+static void device_set_csls(struct device *dev, bool enable) {
+	for (int c = 0; c < dev->num_csu; c++) {
+		csu_set_csl(dev->csu[c], !enable);
+	}
+}
+
+bool dt_enable_device(struct device *dev, bool enable) {
+	bool can_protect = device_can_protect(dev);
+
+	if (dev->enabled == enable) {
+		goto out;
+	}
+
+	// Disabling IRQs for the device
+	device_set_irqs(dev, enable);
 
 	// If device can be protected, set protections and emulation policy
 	if (can_protect) {
 		if (enable) {
-			for (int c = 0; c < dev->num_csu; c++) {
-				csu_set_csl(dev->csu[c], false);
-			}
-
-			for (int r = 0; r < dev->num_resources; r++) {
-				emu_remove_region(dev->resources[r].address[0], dev->resources[r].size[0], emu_deny_all);
-			}
+			device_set_csls(dev, true);
+			device_set_regions(dev, true);
 		} else {
-			for (int r = 0; r < dev->num_resources; r++) {
-				emu_add_region(dev->resources[r].address[0], dev->resources[r].size[0], emu_deny_all);
-			}
-
-			for (int c = 0; c < dev->num_csu; c++) {
-				csu_set_csl(dev->csu[c], true);
-			}
+			device_set_regions(dev, false);
+			device_set_csls(dev, false);
 		}
 	}
 
@@ -427,46 +601,297 @@ out:
 }
 
 
-static bool device_has_class(struct device *dev, const char *name) {
-	for (int c = 0; c < dev->num_classes; c++) {
-		if (strcmp(dev->classes[c], name) == 0) {
-			return true;
+void dt_enable_class_id(int id, bool enable) {
+	if ((id < 0) || (id >= g_num_classes)) {
+		return;
+	}
+
+	struct dt_class *class = &g_classes[id];
+	for (int d = 0; d < class->num_devices; d++) {
+		struct device *dev = class->devices[d];
+		IMSG("[DT] Device '%s' belongs to class '%s'. Enabled? %s", dev->name, class->name, dev->enabled ? "Yes" : "No");
+		if (dev->enabled == enable) {
+			continue;
 		}
+
+		// Go through the device and each of its parents up to the one that protects it
+		struct device *cur;
+		device_for_each_guard(dev, cur) {
+			if (dt_enable_device(cur, enable)) {
+				IMSG("\tProtected by device '%s'", cur->name);
+			}
+		}
+	}
+}
+
+bool dt_is_class_id_enabled(int id) {
+	if ((id < 0) || (id >= g_num_classes) || (g_classes[id].num_devices == 0)) {
+		return false;
 	}
 
-	return false;
+	return g_classes[id].devices[0]->enabled;
 }
 
-void dt_enable_class(const char *name, bool enable) {
-	struct device *dev = NULL;
-	device_for_each(dev) {
-		if (device_has_class(dev, name)) {
-			IMSG("[DT] Device '%s' belongs to class '%s'. Enabled? %s", dev->name, name, dev->enabled ? "Yes" : "No");
-			if (dev->enabled == enable) {
-				continue;
-			}
+/*
+ * A protection plan is the final state of every device affected by a class
+ * setting (including the parents that protect them), with a device disabled
+ * if any of its classes is. The classes of devices are fixed once probed, so
+ * plans are compiled the first time a setting is applied and kept in a small
+ * LRU cache, as users tend to switch between a few modes.
+ */
+#define DT_PLAN_CACHE_SIZE 4
+
+struct dt_plan_entry {
+	struct device *dev;
+	bool enable;
+};
+
+struct dt_plan {
+	uint32_t class_mask;
+	uint32_t enabled_mask;
+	uint32_t last_used;
+	struct dt_plan_entry *entries;
+	int num_entries;
+};
+
+static struct dt_plan g_plans[DT_PLAN_CACHE_SIZE];
+static uint32_t g_plan_clock;
+
+static bool dt_plan_compile(struct dt_plan *plan, uint32_t class_mask, uint32_t enabled_mask) {
+	// Each device appears in the plan at most once, so size it before marking any of them
+	int max_changes = 0;
+	struct device *probed = NULL;
+	device_for_each(probed) {
+		max_changes++;
+	}
+
+	struct dt_plan_entry *entries = malloc(sizeof(*entries) * MAX(max_changes, 1));
+	if (!entries) {
+		EMSG("[DT] Out of memory");
+		return false;
+	}
 
-			// Go through the device and each of its parents until we find one that we can protect
+	struct device *changes = NULL;
+	int num_changes = 0;
+
+	for (int id = 0; id < g_num_classes; id++) {
+		if (!(class_mask & (1U << id))) {
+			continue;
+		}
+
+		struct dt_class *class = &g_classes[id];
+		for (int d = 0; d < class->num_devices; d++) {
+			struct device *dev = class->devices[d];
+			bool enable = !(dev->class_mask & class_mask & ~enabled_mask);
+
+			// As with dt_enable_class, each parent up to the one that protects the device follows it
 			struct device *cur;
-			device_for_each_parent(dev, cur) {
-				if (dt_enable_device(cur, enable)) {
-					IMSG("\tProtected by device '%s'", cur->name);
-					break;
+			device_for_each_guard(dev, cur) {
+				if (cur->txn_next) {
+					cur->txn_enable &= enable;
+				} else {
+					// The list ends at a device pointing to itself, so that txn_next marks membership
+					cur->txn_next = changes ? changes : cur;
+					cur->txn_enable = enable;
+					changes = cur;
+					num_changes++;
 				}
 			}
 		}
 	}
+
+	int e = 0;
+	for (struct device *dev = changes; dev; ) {
+		struct device *next = (dev->txn_next == dev) ? NULL : dev->txn_next;
+		entries[e].dev = dev;
+		entries[e].enable = dev->txn_enable;
+		e++;
+
+		dev->txn_next = NULL;
+		dev = next;
+	}
+
+	free(plan->entries);
+	plan->class_mask = class_mask;
+	plan->enabled_mask = enabled_mask;
+	plan->entries = entries;
+	plan->num_entries = num_changes;
+	return true;
+}
+
+static struct dt_plan *dt_plan_get(uint32_t class_mask, uint32_t enabled_mask) {
+	struct dt_plan *lru = &g_plans[0];
+	for (int p = 0; p < DT_PLAN_CACHE_SIZE; p++) {
+		struct dt_plan *plan = &g_plans[p];
+		if (plan->entries && (plan->class_mask == class_mask) && (plan->enabled_mask == enabled_mask)) {
+			plan->last_used = ++g_plan_clock;
+			return plan;
+		}
+
+		if (!plan->entries || (lru->entries && (plan->last_used < lru->last_used))) {
+			lru = plan;
+		}
+	}
+
+	if (!dt_plan_compile(lru, class_mask, enabled_mask)) {
+		return NULL;
+	}
+
+	lru->last_used = ++g_plan_clock;
+	return lru;
+}
+
+/*
+ * Removes (or adds) the deny-all regions of every protectable device that the
+ * plan enables (or disables), as a single emulation update
+ */
+static void dt_plan_set_regions(struct dt_plan *plan, bool enable) {
+	int num_updates = 0;
+	for (int e = 0; e < plan->num_entries; e++) {
+		struct device *dev = plan->entries[e].dev;
+		if ((dev->enabled != enable) && (plan->entries[e].enable == enable) && device_can_protect(dev)) {
+			num_updates += dev->num_resources;
+		}
+	}
+
+	if (num_updates == 0) {
+		return;
+	}
+
+	struct emu_region_update *updates = malloc(sizeof(*updates) * num_updates);
+	int u = 0;
+	for (int e = 0; e < plan->num_entries; e++) {
+		struct device *dev = plan->entries[e].dev;
+		if ((dev->enabled == enable) || (plan->entries[e].enable != enable) || !device_can_protect(dev)) {
+			continue;
+		}
+
+		// One update per region still works, just with a grace period each
+		if (!updates) {
+			device_set_regions(dev, enable);
+			continue;
+		}
+
+		for (int r = 0; r < dev->num_resources; r++) {
+			updates[u].base = dev->resources[r].address[0];
+			updates[u].size = dev->resources[r].size[0];
+			updates[u].check = emu_deny_all;
+			updates[u].policy = NULL;
+			updates[u].add = !enable;
+			u++;
+		}
+	}
+
+	if (updates) {
+		emu_update_regions(updates, u);
+		free(updates);
+	}
+}
+
+/*
+ * Sets every class in class_mask to enabled or disabled as in enabled_mask, in
+ * one transaction that replays the protection plan for the setting. Only the
+ * devices whose state changes are touched. Devices being disabled are denied
+ * by the emulator before any CSL changes, and devices being enabled lose their
+ * deny regions only after it, so no access can slip through between the two.
+ */
+bool dt_apply_classes(uint32_t class_mask, uint32_t enabled_mask) {
+	struct dt_plan *plan = dt_plan_get(class_mask, enabled_mask);
+	if (!plan) {
+		return false;
+	}
+
+	for (int e = 0; e < plan->num_entries; e++) {
+		struct device *dev = plan->entries[e].dev;
+		if ((dev->enabled != plan->entries[e].enable) && !plan->entries[e].enable) {
+			IMSG("[DT] Disabling device '%s'", dev->name);
+			device_set_irqs(dev, false);
+		}
+	}
+	dt_plan_set_regions(plan, false);
+
+	for (int e = 0; e < plan->num_entries; e++) {
+		struct device *dev = plan->entries[e].dev;
+		if ((dev->enabled != plan->entries[e].enable) && device_can_protect(dev)) {
+			device_set_csls(dev, plan->entries[e].enable);
+		}
+	}
+
+	dt_plan_set_regions(plan, true);
+	for (int e = 0; e < plan->num_entries; e++) {
+		struct device *dev = plan->entries[e].dev;
+		if ((dev->enabled != plan->entries[e].enable) && plan->entries[e].enable) {
+			IMSG("[DT] Enabling device '%s'", dev->name);
+			device_set_irqs(dev, true);
+		}
+		dev->enabled = plan->entries[e].enable;
+	}
+
+	return true;
+}
+
+void dt_enable_class(const char *name, bool enable) {
+	dt_enable_class_id(dt_class_lookup(name), enable);
 }
 
 bool dt_is_class_enabled(const char *name) {
+	return dt_is_class_id_enabled(dt_class_lookup(name));
+}
+
+/*
+ * Once every device has been probed, finds the device that protects each one
+ * (itself or its closest parent with CSLs and memory resources), along with
+ * the class members each protector guards and the devices behind each CSL.
+ */
+static void dt_link_protectors(void) {
 	struct device *dev = NULL;
 	device_for_each(dev) {
-		if (device_has_class(dev, name)) {
-			return dev->enabled;
+		struct device *cur;
+		device_for_each_parent(dev, cur) {
+			if (device_can_protect(cur)) {
+				dev->protector = cur;
+				break;
+			}
+		}
+
+		bool success = true;
+		if (dev->class_mask && dev->protector) {
+			success &= device_array_add(&dev->protector->guarded, &dev->protector->num_guarded, dev);
+		}
+
+		if (device_can_protect(dev)) {
+			for (int c = 0; c < dev->num_csu; c++) {
+				if ((dev->csu[c] < 0) || (dev->csu[c] >= CSU_MAX_CSL)) {
+					EMSG("[DT] Device '%s' has an invalid CSL %d", dev->name, dev->csu[c]);
+					panic();
+				}
+
+				struct dt_csl_users *users = &g_csl_users[dev->csu[c]];
+				success &= device_array_add(&users->devices, &users->num_devices, dev);
+			}
+		}
+
+		if (!success) {
+			panic();
+		}
+	}
+
+	dev = NULL;
+	device_for_each(dev) {
+		if (dev->num_guarded > 0) {
+			IMSG("[DT] Device '%s' guards %d class members", dev->name, dev->num_guarded);
 		}
 	}
 
-	return false;
+	for (int csl = 0; csl < CSU_MAX_CSL; csl++) {
+		struct dt_csl_users *users = &g_csl_users[csl];
+		if (users->num_devices > 1) {
+			IMSG("[DT] CSL %d is shared by %d devices", csl, users->num_devices);
+			for (int d = 0; d < users->num_devices; d++) {
+				IMSG("\t'%s'", users->devices[d]->name);
+			}
+		}
+	}
 }
 
 static TEE_Result dt_probe(void) {
@@ -479,6 +904,8 @@ static TEE_Result dt_probe(void) {
 		SLIST_INIT(&g_device_table.buckets[b].entries);
 	}
 
+	phandle_index(fdt);
+
 	int root = fdt_path_offset(fdt, "/");
 	if (root < 0) {
 		panic();
@@ -496,6 +923,8 @@ static TEE_Result dt_probe(void) {
 		dt_probe_device(fdt, child, root_device, true);
 	}
 
+	dt_link_protectors();
+
 	return 0;
 }
 driver_init(dt_probe);
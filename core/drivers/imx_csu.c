@@ -1,15 +1,56 @@
 #include <drivers/imx_csu.h>
 
+#include <initcall.h>
 #include <kernel/panic.h>
+#include <kernel/spinlock.h>
 #include <mm/core_memprot.h>
 #include <mm/core_mmu.h>
 #include <io.h>
+#include <secloak/emulation.h>
 
-#define MAX_CSL 80
+#define MAX_CSL CSU_MAX_CSL
 #define MAX_SA 16
 
+// Access settings for a CSL, in the bits of the even CSL
+#define CSL_SECURE_ONLY 0x33333333
+#define CSL_NS_READ     0x3F3F3F3F
+#define CSL_ALL_ACCESS  0xFFFFFFFF
+
 static vaddr_t csu_base = 0;
 static int csu_csl_counts[MAX_CSL];
+static int csu_csl_write_counts[MAX_CSL];
+
+/*
+ * Serializes the counts (and demotions) of every CSL. Demotion checks the
+ * emulated regions under it, so it is taken before emu_update_lock, and never
+ * from the trap path.
+ */
+static unsigned int csu_lock = SPINLOCK_UNLOCK;
+
+#ifdef CFG_SECLOAK_CSU_DEMOTE
+/*
+ * Device ranges behind each CSL, used to find out whether emulation would
+ * allow every access to a protected CSL anyway. Such a CSL is demoted: its
+ * protection references are set aside (so csu_csl_counts drops to zero) until
+ * a restrictive region is added in one of its ranges, which restores them
+ * before the region takes effect.
+ */
+#define MAX_CSL_RANGES 128
+
+struct csu_csl_range {
+	int csl;
+	paddr_t base;
+	size_t size;
+};
+
+static struct csu_csl_range csu_csl_ranges[MAX_CSL_RANGES];
+static int csu_num_csl_ranges;
+static int csu_csl_demoted_counts[MAX_CSL];
+static bool csu_csl_demoted[MAX_CSL];
+
+static void __csu_demote_csl(int csl);
+static void __csu_restore_csl(int csl);
+#endif
 
 void csu_init(paddr_t base) {
 	csu_base = (vaddr_t)phys_to_virt(base, MEM_AREA_IO_SEC);
@@ -36,8 +77,46 @@ void csu_init(paddr_t base) {
 	IMSG("[CSU] Initialized");
 }
 
-void csu_set_csl(int csl, bool protect) {	
-	assert((csl >= 0) && (csl < MAX_CSL));
+// Programs a CSL for the strongest protection that is currently requested
+static void csu_update_csl(int csl) {
+	int csl_reg = csl >> 1;
+	vaddr_t csl_addr = csu_base + (4 * csl_reg);
+
+	uint32_t access;
+	if (csu_csl_counts[csl] > 0) {
+		access = CSL_SECURE_ONLY;
+	} else if (csu_csl_write_counts[csl] > 0) {
+		access = CSL_NS_READ;
+	} else {
+		access = CSL_ALL_ACCESS;
+	}
+
+	uint32_t value = read32(csl_addr);
+	uint32_t mask = (csl % 2 == 0) ? 0x000000FF : 0x00FF0000;
+	uint32_t value_new = (value & ~mask) | (access & mask);
+
+	if (value_new != value) {
+		IMSG("[CSU] Updating CSU CSL %d from 0x%X to 0x%X", csl, value, value_new);
+		write32(value_new, csl_addr);
+	}
+}
+
+static void __csu_set_csl(int csl, bool protect) {
+#ifdef CFG_SECLOAK_CSU_DEMOTE
+	if (csu_csl_demoted[csl]) {
+		if (protect) {
+			// New protection likely comes with a new policy, so take the protection back
+			__csu_restore_csl(csl);
+		} else {
+			csu_csl_demoted_counts[csl]--;
+			assert(csu_csl_demoted_counts[csl] >= 0);
+			if (csu_csl_demoted_counts[csl] == 0) {
+				csu_csl_demoted[csl] = false;
+			}
+			return;
+		}
+	}
+#endif
 
 	bool update;
 	if (protect) {
@@ -50,16 +129,45 @@ void csu_set_csl(int csl, bool protect) {
 	}
 
 	if (update) {
-		int csl_reg = csl >> 1;
-		vaddr_t csl_addr = csu_base + (4 * csl_reg);
+		csu_update_csl(csl);
+	}
 
-		uint32_t value = read32(csl_addr);
-		uint32_t mask = (csl % 2 == 0) ? 0x000000FF : 0x00FF0000;
-		uint32_t value_new = (value & ~mask) | ((protect ? 0x33333333 : 0xFFFFFFFF) & mask);
+#ifdef CFG_SECLOAK_CSU_DEMOTE
+	if (protect) {
+		__csu_demote_csl(csl);
+	}
+#endif
+}
 
-		IMSG("[CSU] Updating CSU CSL %d from 0x%X to 0x%X", csl, value, value_new);
-		write32(value_new, csl_addr);
+void csu_set_csl(int csl, bool protect) {
+	assert((csl >= 0) && (csl < MAX_CSL));
+
+	uint32_t exceptions = cpu_spin_lock_xsave(&csu_lock);
+	__csu_set_csl(csl, protect);
+	cpu_spin_unlock_xrestore(&csu_lock, exceptions);
+}
+
+void csu_set_csl_writes(int csl, bool protect) {
+	assert((csl >= 0) && (csl < MAX_CSL));
+
+	uint32_t exceptions = cpu_spin_lock_xsave(&csu_lock);
+
+	bool update;
+	if (protect) {
+		update = (csu_csl_write_counts[csl] == 0);
+		csu_csl_write_counts[csl]++;
+	} else {
+		update = (csu_csl_write_counts[csl] == 1);
+		csu_csl_write_counts[csl]--;
+		assert(csu_csl_write_counts[csl] >= 0);
+	}
+
+	// Fully protected CSLs already trap writes
+	if (update && (csu_csl_counts[csl] == 0)) {
+		csu_update_csl(csl);
 	}
+
+	cpu_spin_unlock_xrestore(&csu_lock, exceptions);
 }
 
 bool csu_is_csl_protected(int csl) {
@@ -81,3 +189,180 @@ void csu_set_sa(int master, bool secure) {
 	write32(value_new, sa_addr);
 }
 
+#ifdef CFG_SECLOAK_CSU_DEMOTE
+static uint32_t csu_csl_traps(int csl) {
+	uint32_t traps = 0;
+	for (int i = 0; i < csu_num_csl_ranges; i++) {
+		if (csu_csl_ranges[i].csl == csl) {
+			traps += emu_stats_traps(csu_csl_ranges[i].base, csu_csl_ranges[i].size);
+		}
+	}
+
+	return traps;
+}
+
+void csu_add_csl_range(int csl, paddr_t base, size_t size) {
+	assert((csl >= 0) && (csl < MAX_CSL));
+
+	uint32_t exceptions = cpu_spin_lock_xsave(&csu_lock);
+
+	if (csu_num_csl_ranges == MAX_CSL_RANGES) {
+		EMSG("[CSU] Too many CSL ranges, CSL %d will not be demoted", csl);
+	} else {
+		csu_csl_ranges[csu_num_csl_ranges].csl = csl;
+		csu_csl_ranges[csu_num_csl_ranges].base = base;
+		csu_csl_ranges[csu_num_csl_ranges].size = size;
+		csu_num_csl_ranges++;
+	}
+
+	cpu_spin_unlock_xrestore(&csu_lock, exceptions);
+}
+
+// Drops the protection of a CSL if emulation allows every access to all of its ranges
+static void __csu_demote_csl(int csl) {
+	if (csu_csl_demoted[csl] || (csu_csl_counts[csl] == 0)) {
+		return;
+	}
+
+	bool has_ranges = false;
+	for (int i = 0; i < csu_num_csl_ranges; i++) {
+		if (csu_csl_ranges[i].csl == csl) {
+			if (!emu_range_allows_all(csu_csl_ranges[i].base, csu_csl_ranges[i].size)) {
+				return;
+			}
+			has_ranges = true;
+		}
+	}
+
+	if (!has_ranges) {
+		return;
+	}
+
+	IMSG("[CSU] Demoting CSL %d, all of its regions allow every access (%u traps so far)", csl, csu_csl_traps(csl));
+
+	csu_csl_demoted_counts[csl] = csu_csl_counts[csl];
+	csu_csl_demoted[csl] = true;
+	csu_csl_counts[csl] = 0;
+	csu_update_csl(csl);
+}
+
+static void __csu_restore_csl(int csl) {
+	if (!csu_csl_demoted[csl]) {
+		return;
+	}
+
+	IMSG("[CSU] Restoring CSL %d (%u traps so far)", csl, csu_csl_traps(csl));
+
+	csu_csl_counts[csl] = csu_csl_demoted_counts[csl];
+	csu_csl_demoted_counts[csl] = 0;
+	csu_csl_demoted[csl] = false;
+	csu_update_csl(csl);
+}
+
+void csu_demote_csl(int csl) {
+	assert((csl >= 0) && (csl < MAX_CSL));
+
+	uint32_t exceptions = cpu_spin_lock_xsave(&csu_lock);
+	__csu_demote_csl(csl);
+	cpu_spin_unlock_xrestore(&csu_lock, exceptions);
+}
+
+void csu_restore_csl(int csl) {
+	assert((csl >= 0) && (csl < MAX_CSL));
+
+	uint32_t exceptions = cpu_spin_lock_xsave(&csu_lock);
+	__csu_restore_csl(csl);
+	cpu_spin_unlock_xrestore(&csu_lock, exceptions);
+}
+
+void csu_demote_range(paddr_t base, size_t size) {
+	uint32_t exceptions = cpu_spin_lock_xsave(&csu_lock);
+
+	for (int i = 0; i < csu_num_csl_ranges; i++) {
+		struct csu_csl_range *range = &csu_csl_ranges[i];
+		if ((range->base < base + size) && (base < range->base + range->size)) {
+			__csu_demote_csl(range->csl);
+		}
+	}
+
+	cpu_spin_unlock_xrestore(&csu_lock, exceptions);
+}
+
+void csu_restore_range(paddr_t base, size_t size) {
+	uint32_t exceptions = cpu_spin_lock_xsave(&csu_lock);
+
+	for (int i = 0; i < csu_num_csl_ranges; i++) {
+		struct csu_csl_range *range = &csu_csl_ranges[i];
+		if ((range->base < base + size) && (base < range->base + range->size)) {
+			__csu_restore_csl(range->csl);
+		}
+	}
+
+	cpu_spin_unlock_xrestore(&csu_lock, exceptions);
+}
+
+#ifdef CFG_SECLOAK_EMU_BENCH
+// Whether every range of the CSL is mapped, so that its accesses can be emulated
+static bool csu_csl_mapped(int csl) {
+	bool has_ranges = false;
+	for (int i = 0; i < csu_num_csl_ranges; i++) {
+		if (csu_csl_ranges[i].csl == csl) {
+			if (!phys_to_virt(csu_csl_ranges[i].base, MEM_AREA_IO_SEC)) {
+				return false;
+			}
+			has_ranges = true;
+		}
+	}
+
+	return has_ranges;
+}
+
+static void csu_set_csl_allow_all(int csl, bool add) {
+	for (int i = 0; i < csu_num_csl_ranges; i++) {
+		if (csu_csl_ranges[i].csl == csl) {
+			if (add) {
+				emu_add_region(csu_csl_ranges[i].base, csu_csl_ranges[i].size, emu_allow_all);
+			} else {
+				emu_remove_region(csu_csl_ranges[i].base, csu_csl_ranges[i].size, emu_allow_all);
+			}
+		}
+	}
+}
+
+/*
+ * Protects an unprotected CSL with allow-all regions over its ranges, which
+ * must demote it right away, then unprotects it again. While the CSL is
+ * briefly protected, NS accesses to it are emulated and allowed.
+ */
+static TEE_Result csu_demote_test(void) {
+	int csl;
+	for (csl = 0; csl < MAX_CSL; csl++) {
+		if ((csu_csl_counts[csl] == 0) && (csu_csl_write_counts[csl] == 0) && !csu_csl_demoted[csl] && csu_csl_mapped(csl)) {
+			break;
+		}
+	}
+
+	if (csl == MAX_CSL) {
+		IMSG("[CSU] Demotion test skipped, no unprotected CSL with mapped ranges");
+		return 0;
+	}
+
+	csu_set_csl_allow_all(csl, true);
+	csu_set_csl(csl, true);
+	bool demoted = csu_csl_demoted[csl] && !csu_is_csl_protected(csl);
+	csu_set_csl(csl, false);
+	csu_set_csl_allow_all(csl, false);
+
+	bool restored = !csu_csl_demoted[csl] && !csu_is_csl_protected(csl);
+	if (demoted && restored) {
+		IMSG("[CSU] Demotion test on CSL %d passed", csl);
+	} else {
+		EMSG("[CSU] Demotion test on CSL %d failed (demoted? %s, cleaned up? %s)", csl, demoted ? "Yes" : "No",
+		     restored ? "Yes" : "No");
+	}
+
+	return 0;
+}
+driver_init_late(csu_demote_test);
+#endif
+#endif
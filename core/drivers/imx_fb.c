@@ -29,6 +29,7 @@
 #include <platform_config.h>
 #include <secloak/emulation.h>
 #include <string.h>
+#include <util.h>
 
 static paddr_t g_base_paddr;
 static paddr_t g_base_vaddr;
@@ -82,22 +83,23 @@ static void ipu_ch_param_write_field(vaddr_t base, int channel, int w, int bit,
 	}
 }
 
-static bool fb_emu_check(struct region *region __unused, paddr_t address, enum emu_state state, uint32_t *value __unused) {
-	paddr_t offset = address - region->base;
-	switch (offset) {
-		case 0x3005E0: // Buffer 0 Address Register
-		case 0x3005E4: // Buffer 1 Address Register
-		case 0x301160: // Buffer 2 Address Register
-			return (state != EMU_STATE_WRITE);
-		default:
-			return true;
-	}
-}
+static struct emu_reg_policy fb_policy_regs[] = {
+	{ .offset = 0x3005E0, .flags = EMU_POLICY_DENY_WRITE, .read_mask = 0xFFFFFFFF, .write_mask = 0xFFFFFFFF }, // Buffer 0 Address Register
+	{ .offset = 0x3005E4, .flags = EMU_POLICY_DENY_WRITE, .read_mask = 0xFFFFFFFF, .write_mask = 0xFFFFFFFF }, // Buffer 1 Address Register
+	{ .offset = 0x301160, .flags = EMU_POLICY_DENY_WRITE, .read_mask = 0xFFFFFFFF, .write_mask = 0xFFFFFFFF }, // Buffer 2 Address Register
+};
+
+// The NS IPU driver only relies on register writes landing before its next read or barrier
+static struct emu_policy fb_policy = {
+	.num_regs = ARRAY_SIZE(fb_policy_regs),
+	.regs = fb_policy_regs,
+	.posted = true,
+};
 
 bool fb_acquire(struct fb_info *info, uint8_t r, uint8_t g, uint8_t b) {
-	// Deny non-secure transactions to the buffers
-	emu_add_region(g_base_paddr, 0x400000, fb_emu_check);
-	csu_set_csl(61, true);
+	// Deny non-secure writes to the buffers, reads are not emulated by the policy
+	emu_add_policy_region(g_base_paddr, 0x400000, &fb_policy);
+	csu_set_csl_writes(61, true);
 
 	// Save the previous set of parameters for later restoration
 	for (int p = 0; p < 16; p++) {
@@ -155,9 +157,9 @@ void fb_release(struct fb_info *info) {
 
 	info->buffer = NULL;
 
-	// Allow non-secure transactions to the buffers
-	csu_set_csl(61, false);
-	emu_remove_region(g_base_paddr, 0x400000, fb_emu_check);
+	// Allow non-secure writes to the buffers
+	csu_set_csl_writes(61, false);
+	emu_remove_policy_region(g_base_paddr, 0x400000, &fb_policy);
 }
 
 void fb_clear(struct fb_info *info, uint8_t r, uint8_t g, uint8_t b) {
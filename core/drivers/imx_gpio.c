@@ -32,6 +32,7 @@
 #include <kernel/dt.h>
 #include <kernel/interrupt.h>
 #include <kernel/panic.h>
+#include <kernel/spinlock.h>
 #include <malloc.h>
 #include <mm/core_memprot.h>
 #include <mm/core_mmu.h>
@@ -81,6 +82,24 @@ static const struct irq_chip_ops irq_ops = {
 	.raise = irq_op_raise,
 };
 
+enum gpio_policy_reg {
+	GPIO_POLICY_DR,
+	GPIO_POLICY_GDIR,
+	GPIO_POLICY_ISR,
+	GPIO_POLICY_IMR,
+	GPIO_POLICY_ICR1,
+	GPIO_POLICY_ICR2,
+	GPIO_POLICY_PSR,
+	GPIO_POLICY_DR_SET,
+	GPIO_POLICY_DR_CLR,
+	GPIO_POLICY_DR_TOGGLE,
+	GPIO_POLICY_IMR_SET,
+	GPIO_POLICY_IMR_CLR,
+	GPIO_POLICY_IMR_TOGGLE,
+	GPIO_POLICY_EDGE_SEL,
+	GPIO_POLICY_NUM_REGS,
+};
+
 struct mxc_gpio_port {
 	SLIST_ENTRY(mxc_gpio_port) node;
 	struct device *dev;
@@ -97,6 +116,9 @@ struct mxc_gpio_port {
 	uint32_t secure_mask;
 	uint32_t secure_irq_mask;
 	uint32_t passed_irq_mask;
+	unsigned int lock;
+	struct emu_reg_policy policy_regs[GPIO_POLICY_NUM_REGS];
+	struct emu_policy policy;
 };
 
 static struct mxc_gpio_hwdata imx1_imx21_gpio_hwdata = {
@@ -175,6 +197,33 @@ enum {
 	IRQ_TYPE_LEVEL_LOW	= 0x00000008,
 };
 
+// Writes a register that the emulation policy may be shadowing
+static void gpio_write_reg(struct mxc_gpio_port *port, vaddr_t reg, uint32_t value) {
+	write32(value, reg);
+
+	uint32_t offset = reg - port->base;
+	for (int i = 0; i < port->policy.num_regs; i++) {
+		if (port->policy_regs[i].offset == offset) {
+			emu_shadow_invalidate(&port->policy_regs[i]);
+			break;
+		}
+	}
+}
+
+/*
+ * Read-modify-write of a register shared between the secure world and the NS
+ * world's alias registers, which would otherwise race on other cores
+ */
+static uint32_t gpio_modify_reg(struct mxc_gpio_port *port, vaddr_t reg, uint32_t clear, uint32_t set, uint32_t toggle) {
+	uint32_t exceptions = cpu_spin_lock_xsave(&port->lock);
+
+	uint32_t value = ((read32(reg) & ~clear) | set) ^ toggle;
+	gpio_write_reg(port, reg, value);
+
+	cpu_spin_unlock_xrestore(&port->lock, exceptions);
+	return value;
+}
+
 static int gpio_get_value(struct mxc_gpio_port *port, int index)
 {
 	uint32_t psr = read32(port->base + GPIO_PSR);
@@ -184,15 +233,14 @@ static int gpio_get_value(struct mxc_gpio_port *port, int index)
 static void gpio_set_dir(struct mxc_gpio_port *port, int index, int direction) {
 	uint32_t gdir = read32(port->base + GPIO_GDIR);
 	gdir = (gdir & ~(1 << index)) | (direction << index);
-	write32(gdir, port->base + GPIO_GDIR);
+	gpio_write_reg(port, port->base + GPIO_GDIR, gdir);
 }
 
 static void gpio_irq_mask(struct mxc_gpio_port *port, int index, bool mask) {
-	uint32_t imr = read32(port->base + GPIO_IMR);
 	if (mask) {
-		write32(imr & ~(1 << index), port->base + GPIO_IMR);
+		gpio_modify_reg(port, port->base + GPIO_IMR, 1 << index, 0, 0);
 	} else {
-		write32(imr | (1 << index), port->base + GPIO_IMR);
+		gpio_modify_reg(port, port->base + GPIO_IMR, 0, 1 << index, 0);
 	}
 }
 
@@ -239,16 +287,16 @@ static int gpio_set_irq_type(struct mxc_gpio_port *port, int index, uint32_t typ
 	if (GPIO_EDGE_SEL >= 0) {
 		val = read32(port->base + GPIO_EDGE_SEL);
 		if (edge == GPIO_INT_BOTH_EDGES)
-			write32(val | (1 << index), port->base + GPIO_EDGE_SEL);
+			gpio_write_reg(port, port->base + GPIO_EDGE_SEL, val | (1 << index));
 		else
-			write32(val & ~(1 << index), port->base + GPIO_EDGE_SEL);
+			gpio_write_reg(port, port->base + GPIO_EDGE_SEL, val & ~(1 << index));
 	}
 
 	if (edge != GPIO_INT_BOTH_EDGES) {
 		vaddr_t reg = port->base + GPIO_ICR1 + ((index & 0x10) >> 2);
 		bit = index & 0xf;
 		val = read32(reg) & ~(0x3 << (bit << 1));
-		write32(val | (edge << (bit << 1)), reg);
+		gpio_write_reg(port, reg, val | (edge << (bit << 1)));
 	}
 
 	write32(1 << index, port->base + GPIO_ISR);
@@ -278,105 +326,158 @@ struct mxc_gpio_port *gpio_port_from_address(paddr_t base) {
 	return port;
 }
 
-static bool gpio_emu_check(struct region *region, paddr_t address, enum emu_state state, uint32_t *value) {
-	struct mxc_gpio_port *port = gpio_port_from_address(region->base);
-	paddr_t offset = address - region->base;
+static bool gpio_isr_emu_check(struct region *region, paddr_t address __unused, enum emu_state state, uint32_t *value);
+static bool gpio_alias_emu_check(struct region *region, paddr_t address, enum emu_state state, uint32_t *value);
 
-	bool allowed = true;
-	if (offset == GPIO_DR) {
-		switch(state) {
-			case EMU_STATE_WRITE:
-				if ((read32(port->base + GPIO_DR) & port->secure_mask) != (*value & port->secure_mask)) {
-					allowed = false;
-				}
-				break;
-			case EMU_STATE_READ_AFTER:
-				*value &= ~port->secure_mask;
-				break;
-			default:
-				break;
-		}
-	} else if (offset == GPIO_GDIR) {
-		switch (state) {
-			case EMU_STATE_WRITE:
-				if ((read32(port->base + GPIO_GDIR) & port->secure_mask) != (*value & port->secure_mask)) {
-					allowed = false;
-				}
-				break;
-			case EMU_STATE_READ_AFTER:
-				*value &= ~port->secure_mask;
-				break;
-			default:
-				break;
-		}
-	} else if (offset == GPIO_ISR) {
-		switch (state) {
-			case EMU_STATE_WRITE:
-				if ((*value & port->secure_mask) != 0) {
-					if ((*value & port->passed_irq_mask) == *value) {
-						port->passed_irq_mask &= ~(*value);
-						write32(read32(port->base + GPIO_IMR) | *value, port->base + GPIO_IMR);
-					} else {
-						allowed = false;
-					}
-				}
-				break;
-			case EMU_STATE_READ_AFTER:
-				*value = (*value & ~port->secure_mask) | port->passed_irq_mask;
-				break;
-			default:
-				break;
-		}
-	} else if (offset == GPIO_IMR) {
-		switch (state) {
-			case EMU_STATE_WRITE:
-				if ((~(*value) & port->secure_mask) != 0) {
-					allowed = false;
-				}
-				break;
-			case EMU_STATE_READ_AFTER:
-				*value = (*value & ~port->secure_mask) | port->passed_irq_mask;
-				break;
-			default:
-				break;
-		}
-	} else if (offset == GPIO_PSR) {
-		// FIXME: Linux does strange things with this after acking via ISR. Allowing it for now...
-		/*
-		if (state == EMU_STATE_READ_AFTER) {
-			*value &= ~port->secure_mask | port->passed_irq_mask;
-		}
-		*/
-	} else if (offset == (uint32_t)GPIO_EDGE_SEL) {
-		switch (state) {
-			case EMU_STATE_WRITE:
-				if (((*value) & port->secure_mask) != (read32(port->base + GPIO_EDGE_SEL) & port->secure_mask)) {
-					allowed = false;
-				}
-				break;
-			default:
-				break;
-		}
-	} else if (offset == GPIO_ICR1 || offset == GPIO_ICR2) {
-		uint32_t secure_icr_mask = 0;
-		for (int i = 0; i < 16; i++) {
-			if (port->secure_mask & (1 << (i + (offset == GPIO_ICR2 ? 16 : 0)))) {
-				secure_icr_mask |= (0x3 << (2 * i));
-			}
+// Expands a mask of 16 pins into the 2-bit fields of an ICR register
+static uint32_t gpio_icr_mask(uint32_t pins) {
+	uint32_t mask = 0;
+	for (int i = 0; i < 16; i++) {
+		if (pins & (1 << i)) {
+			mask |= (0x3 << (2 * i));
 		}
+	}
 
-		switch (state) {
-			case EMU_STATE_WRITE:
-				if (((*value) & secure_icr_mask) != (read32(port->base + offset) & secure_icr_mask)) {
-					allowed = false;
-				}
-				break;
-			default:
-				break;
+	return mask;
+}
+
+// Recomputes the masks of the emulation policy after secure_mask or passed_irq_mask changes
+static void gpio_update_policy(struct mxc_gpio_port *port) {
+	struct emu_reg_policy *regs = port->policy_regs;
+	uint32_t secure_mask = port->secure_mask;
+	uint32_t passed_irq_mask = port->passed_irq_mask;
+
+	regs[GPIO_POLICY_DR].read_mask = ~secure_mask;
+	regs[GPIO_POLICY_DR].match_mask = secure_mask;
+
+	regs[GPIO_POLICY_GDIR].read_mask = ~secure_mask;
+	regs[GPIO_POLICY_GDIR].match_mask = secure_mask;
+
+	regs[GPIO_POLICY_ISR].read_mask = ~secure_mask;
+	regs[GPIO_POLICY_ISR].read_value = passed_irq_mask;
+
+	// NS writes must keep the bits of secure IRQs set (unmasked), as match_value is all ones
+	regs[GPIO_POLICY_IMR].read_mask = ~secure_mask;
+	regs[GPIO_POLICY_IMR].read_value = passed_irq_mask;
+	regs[GPIO_POLICY_IMR].match_mask = secure_mask;
+
+	regs[GPIO_POLICY_ICR1].match_mask = gpio_icr_mask(secure_mask & 0xFFFF);
+	regs[GPIO_POLICY_ICR2].match_mask = gpio_icr_mask(secure_mask >> 16);
+	regs[GPIO_POLICY_EDGE_SEL].match_mask = secure_mask;
+}
+
+static void gpio_init_policy(struct mxc_gpio_port *port) {
+	static const struct {
+		uint32_t flags;
+		emu_check_t hook;
+	} reg_info[GPIO_POLICY_NUM_REGS] = {
+		[GPIO_POLICY_DR] = { EMU_POLICY_MATCH_CURRENT, NULL },
+		[GPIO_POLICY_GDIR] = { EMU_POLICY_MATCH_CURRENT | EMU_POLICY_SHADOW, NULL },
+		[GPIO_POLICY_ISR] = { EMU_POLICY_POLLABLE, gpio_isr_emu_check },
+		[GPIO_POLICY_IMR] = { EMU_POLICY_SHADOW, NULL },
+		[GPIO_POLICY_ICR1] = { EMU_POLICY_MATCH_CURRENT | EMU_POLICY_SHADOW, NULL },
+		[GPIO_POLICY_ICR2] = { EMU_POLICY_MATCH_CURRENT | EMU_POLICY_SHADOW, NULL },
+		[GPIO_POLICY_PSR] = { EMU_POLICY_POLLABLE, NULL },
+		[GPIO_POLICY_DR_SET] = { EMU_POLICY_VIRTUAL, gpio_alias_emu_check },
+		[GPIO_POLICY_DR_CLR] = { EMU_POLICY_VIRTUAL, gpio_alias_emu_check },
+		[GPIO_POLICY_DR_TOGGLE] = { EMU_POLICY_VIRTUAL, gpio_alias_emu_check },
+		[GPIO_POLICY_IMR_SET] = { EMU_POLICY_VIRTUAL, gpio_alias_emu_check },
+		[GPIO_POLICY_IMR_CLR] = { EMU_POLICY_VIRTUAL, gpio_alias_emu_check },
+		[GPIO_POLICY_IMR_TOGGLE] = { EMU_POLICY_VIRTUAL, gpio_alias_emu_check },
+		[GPIO_POLICY_EDGE_SEL] = { EMU_POLICY_MATCH_CURRENT | EMU_POLICY_SHADOW, NULL },
+	};
+	uint32_t offsets[GPIO_POLICY_NUM_REGS] = {
+		[GPIO_POLICY_DR] = GPIO_DR,
+		[GPIO_POLICY_GDIR] = GPIO_GDIR,
+		[GPIO_POLICY_ISR] = GPIO_ISR,
+		[GPIO_POLICY_IMR] = GPIO_IMR,
+		[GPIO_POLICY_ICR1] = GPIO_ICR1,
+		[GPIO_POLICY_ICR2] = GPIO_ICR2,
+		[GPIO_POLICY_PSR] = GPIO_PSR,
+		[GPIO_POLICY_DR_SET] = GPIO_ALIAS_DR_SET,
+		[GPIO_POLICY_DR_CLR] = GPIO_ALIAS_DR_CLR,
+		[GPIO_POLICY_DR_TOGGLE] = GPIO_ALIAS_DR_TOGGLE,
+		[GPIO_POLICY_IMR_SET] = GPIO_ALIAS_IMR_SET,
+		[GPIO_POLICY_IMR_CLR] = GPIO_ALIAS_IMR_CLR,
+		[GPIO_POLICY_IMR_TOGGLE] = GPIO_ALIAS_IMR_TOGGLE,
+		[GPIO_POLICY_EDGE_SEL] = GPIO_EDGE_SEL,
+	};
+
+	for (int i = 0; i < GPIO_POLICY_NUM_REGS; i++) {
+		struct emu_reg_policy *reg = &port->policy_regs[i];
+		reg->offset = offsets[i];
+		reg->flags = reg_info[i].flags;
+		reg->read_mask = 0xFFFFFFFF;
+		reg->read_value = 0;
+		reg->write_mask = 0xFFFFFFFF;
+		reg->match_mask = 0;
+		reg->match_value = 0xFFFFFFFF;
+		reg->hook = reg_info[i].hook;
+		reg->shadow_seq = 0;
+		reg->shadow_valid = false;
+	}
+
+	// Only some variants have an EDGE_SEL register, which is last in the table
+	port->policy.regs = port->policy_regs;
+	port->policy.num_regs = (GPIO_EDGE_SEL >= 0) ? GPIO_POLICY_NUM_REGS : GPIO_POLICY_EDGE_SEL;
+
+	gpio_update_policy(port);
+}
+
+// Acking a passed IRQ through ISR also unmasks it again, which the table alone cannot express
+static bool gpio_isr_emu_check(struct region *region, paddr_t address __unused, enum emu_state state, uint32_t *value) {
+	struct mxc_gpio_port *port = container_of(region->policy, struct mxc_gpio_port, policy);
+
+	if ((state == EMU_STATE_WRITE) && ((*value & port->secure_mask) != 0)) {
+		if ((*value & port->passed_irq_mask) != *value) {
+			return false;
 		}
+
+		port->passed_irq_mask &= ~(*value);
+		gpio_update_policy(port);
+		gpio_modify_reg(port, port->base + GPIO_IMR, 0, *value, 0);
+	}
+
+	return true;
+}
+
+// Implements the virtual SET/CLR/TOGGLE registers, which do all of the work on writes
+static bool gpio_alias_emu_check(struct region *region, paddr_t address, enum emu_state state, uint32_t *value) {
+	struct mxc_gpio_port *port = container_of(region->policy, struct mxc_gpio_port, policy);
+
+	if (state != EMU_STATE_WRITE) {
+		return true;
 	}
 
-	return allowed;
+	if (*value & port->secure_mask) {
+		return false;
+	}
+
+	uint32_t bits = *value;
+	switch (address - region->base) {
+		case GPIO_ALIAS_DR_SET:
+			*value = gpio_modify_reg(port, port->base + GPIO_DR, 0, bits, 0);
+			break;
+		case GPIO_ALIAS_DR_CLR:
+			*value = gpio_modify_reg(port, port->base + GPIO_DR, bits, 0, 0);
+			break;
+		case GPIO_ALIAS_DR_TOGGLE:
+			*value = gpio_modify_reg(port, port->base + GPIO_DR, 0, 0, bits);
+			break;
+		case GPIO_ALIAS_IMR_SET:
+			*value = gpio_modify_reg(port, port->base + GPIO_IMR, 0, bits, 0);
+			break;
+		case GPIO_ALIAS_IMR_CLR:
+			*value = gpio_modify_reg(port, port->base + GPIO_IMR, bits, 0, 0);
+			break;
+		case GPIO_ALIAS_IMR_TOGGLE:
+			*value = gpio_modify_reg(port, port->base + GPIO_IMR, 0, 0, bits);
+			break;
+		default:
+			return false;
+	}
+
+	return true;
 }
 
 static bool gpio_parse_dt(const uint32_t *gpio_info, struct mxc_gpio_port **port, int *index, int *flags) {
@@ -400,6 +501,7 @@ static bool __gpio_acquire(struct mxc_gpio_port *port, int index) {
 		return false;
 	}
 	port->secure_mask |= mask;
+	gpio_update_policy(port);
 
 	IMSG("[GPIO] Acquired pin %d on port 0x%lX", index, port->pbase);
 
@@ -434,6 +536,7 @@ bool gpio_release(struct mxc_gpio_port *port, int index) {
 		return false;
 	}
 	port->secure_mask &= ~mask;
+	gpio_update_policy(port);
 
 	IMSG("[GPIO] Released pin %d on port 0x%lX", index, port->pbase);
 
@@ -454,13 +557,11 @@ bool gpio_read(struct mxc_gpio_port *port, int index) {
 
 void gpio_write(struct mxc_gpio_port *port, int index, bool value) {
 	uint32_t mask = 1 << index;
-	uint32_t dr = read32(port->base + GPIO_DR);
 	if (value) {
-		dr |= mask;
+		gpio_modify_reg(port, port->base + GPIO_DR, 0, mask, 0);
 	} else {
-		dr &= ~mask;
+		gpio_modify_reg(port, port->base + GPIO_DR, mask, 0, 0);
 	}
-	write32(dr, port->base + GPIO_DR);
 }
 
 static void mxc_flip_edge(struct mxc_gpio_port *port, uint32_t gpio)
@@ -483,7 +584,7 @@ static void mxc_flip_edge(struct mxc_gpio_port *port, uint32_t gpio)
 		return;
 	}
 
-	write32(val | (edge << (bit << 1)), reg);
+	gpio_write_reg(port, reg, val | (edge << (bit << 1)));
 }
 
 static inline unsigned int __clz(unsigned int x) {
@@ -526,6 +627,8 @@ static void mxc_gpio_irq_handler(struct mxc_gpio_port *port, uint32_t irq_stat)
 		irq_stat &= ~(1 << irqoffset);
 	}
 
+	gpio_update_policy(port);
+
 	if (port->passed_irq_mask) {
 		irq_raise(port->irq_pass);
 	}
@@ -591,6 +694,7 @@ static int mxc_gpio_probe(const void *fdt __unused, struct device *dev, const vo
 		return -ENOMEM;
 	}
 	memset(port, 0, sizeof(*port));
+	port->lock = SPINLOCK_UNLOCK;
 
 	bool first_port = !mxc_gpio_hwdata;
 	mxc_gpio_get_hw(data);
@@ -637,7 +741,8 @@ static int mxc_gpio_probe(const void *fdt __unused, struct device *dev, const vo
 
 	port->irq_pass = dev->num_irqs == 3 ? &dev->irqs[2].desc : &dev->irqs[1].desc;
 
-	emu_add_region(port->pbase, port->dev->resources[0].size[0], gpio_emu_check);
+	gpio_init_policy(port);
+	emu_add_policy_region(port->pbase, port->dev->resources[0].size[0], &port->policy);
 	csu_set_csl(port->dev->csu[0], true);
 
 	irq_construct_chip(&port->irq_chip, dev, &irq_ops, 32, port, true);
@@ -701,6 +806,7 @@ static int32_t irq_op_disable(struct irq_chip *chip, size_t irq) {
 static int32_t irq_op_secure(struct irq_chip *chip, size_t irq) {
 	struct mxc_gpio_port *port = chip->data;
 	port->secure_mask |= (1 << irq);
+	gpio_update_policy(port);
 	IMSG("[GPIO] Secured IRQ %d on Port 0x%lX", irq, port->pbase);
 	return 0;
 }
@@ -708,6 +814,7 @@ static int32_t irq_op_secure(struct irq_chip *chip, size_t irq) {
 static int32_t irq_op_unsecure(struct irq_chip *chip, size_t irq) {
 	struct mxc_gpio_port *port = chip->data;
 	port->secure_mask &= ~(1 << irq);
+	gpio_update_policy(port);
 	IMSG("[GPIO] Unsecured IRQ %d on Port 0x%lX", irq, port->pbase);
 	return 0;
 }
@@ -25,6 +25,9 @@ struct irq_info {
 	uint32_t flags;
 };
 
+// Maximum number of distinct sp-class names, each interned as a bit in class_mask
+#define DT_MAX_CLASSES 32
+
 struct device {
 	int node;
 	uint32_t phandle;
@@ -39,8 +42,12 @@ struct device {
 	int num_irqs;
 	int *csu;
 	int num_csu;
-	const char **classes;
-	int num_classes;
+	uint32_t class_mask;
+	struct device *protector;
+	struct device **guarded;
+	int num_guarded;
+	struct device *txn_next;
+	bool txn_enable;
 	bool enabled;
 	bool probed;
 	bool is_simple_bus;
@@ -49,6 +56,11 @@ struct device {
 
 struct device *dt_lookup_device(const void *fdt, fdt32_t phandle);
 bool dt_enable_device(struct device *dev, bool enable);
+struct device **dt_csl_devices(int csl, int *num_devices);
+int dt_class_lookup(const char *name);
+void dt_enable_class_id(int id, bool enable);
+bool dt_is_class_id_enabled(int id);
+bool dt_apply_classes(uint32_t class_mask, uint32_t enabled_mask);
 void dt_enable_class(const char *name, bool enable);
 bool dt_is_class_enabled(const char *name);
 
@@ -1,16 +1,42 @@
 #ifndef DRIVERS_IMXCSU_H
 #define DRIVERS_IMXCSU_H
 
+#include <compiler.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <types_ext.h>
 
+#define CSU_MAX_CSL 80
+
 void csu_init(paddr_t base);
 
 void csu_set_csl(int csl, bool protect);
+// Only NS writes are blocked (and trapped), NS reads go straight to the device
+void csu_set_csl_writes(int csl, bool protect);
 bool csu_is_csl_protected(int csl);
 
 void csu_set_sa(int master, bool secure);
 
+#ifdef CFG_SECLOAK_CSU_DEMOTE
+void csu_add_csl_range(int csl, paddr_t base, size_t size);
+
+void csu_demote_csl(int csl);
+void csu_restore_csl(int csl);
+
+// Called by emulation when regions in the range become permissive or restrictive
+void csu_demote_range(paddr_t base, size_t size);
+void csu_restore_range(paddr_t base, size_t size);
+#else
+static inline void csu_add_csl_range(int csl __unused, paddr_t base __unused, size_t size __unused) {
+}
+
+static inline void csu_demote_range(paddr_t base __unused, size_t size __unused) {
+}
+
+static inline void csu_restore_range(paddr_t base __unused, size_t size __unused) {
+}
+#endif
+
 #endif
 
@@ -5,6 +5,18 @@
 #include <stdint.h>
 #include <types_ext.h>
 
+/*
+ * Virtual registers emulated for the NS world at these offsets from each port,
+ * which set, clear or toggle the bits written in DR or IMR as a single atomic
+ * read-modify-write. Writes naming a secure pin are denied, and reads return 0.
+ */
+#define GPIO_ALIAS_DR_SET     0x100
+#define GPIO_ALIAS_DR_CLR     0x104
+#define GPIO_ALIAS_DR_TOGGLE  0x108
+#define GPIO_ALIAS_IMR_SET    0x110
+#define GPIO_ALIAS_IMR_CLR    0x114
+#define GPIO_ALIAS_IMR_TOGGLE 0x118
+
 struct mxc_gpio_port;
 
 struct mxc_gpio_port *gpio_port_from_address(paddr_t base);
@@ -235,3 +235,58 @@ CFG_GP_SOCKETS ?= n
 # Enable Secure Data Path support in OP-TEE core (TA may be invoked with
 # invocation parameters referring to specific secure memories).
 CFG_SECURE_DATA_PATH ?= n
+
+# SeCloak: Run a micro-benchmark of the emulation trap path at boot and print
+# the results. Uses the PMU cycle counter, which is enabled as a side effect.
+CFG_SECLOAK_EMU_BENCH ?= n
+
+# SeCloak: Handle trapped word/byte LDR/STR accesses to allow-all and deny-all
+# regions in the monitor's data abort handler without calling into C.
+CFG_SECLOAK_EMU_FAST_PATH ?= y
+
+# SeCloak: Maximum number of NS instructions following a trapped access that
+# are emulated in the same trap (0 disables run-ahead).
+CFG_SECLOAK_EMU_RUN_AHEAD ?= 8
+
+# SeCloak: Keep per-core, per-register counts and PMU cycles for trapped
+# accesses, which can be dumped through OPTEE_SMC_CLOAK_EMU_STATS. Every trap
+# then takes the slow path, bypassing CFG_SECLOAK_EMU_FAST_PATH.
+#
+# Note that statistics, tracing, polling and storm detection all read the PMU
+# cycle counter, which is shared with the NS world. The first trap that needs it
+# on a core sets PMCR.E, clears PMCR.DP and enables the counter in PMCNTENSET,
+# which the NS world can observe (and undo, at the cost of the cycle figures).
+CFG_SECLOAK_EMU_STATS ?= n
+
+# SeCloak: Allow every emulated access to be traced into a ring in NS shared
+# memory, which is set up through OPTEE_SMC_CLOAK_EMU_TRACE.
+CFG_SECLOAK_EMU_TRACE ?= y
+
+# SeCloak: Cache NS instruction page translations per core, keyed on the NS
+# TTBR0/TTBR1/CONTEXTIDR, instead of translating the faulting PC on every trap.
+# NS TLB maintenance is not seen, so a page remapped under the same context is
+# only re-translated on a decode cache miss. If the old PA still holds the same
+# instruction word, the trap is emulated against the old page, including any
+# run-ahead and PC-relative loads. Disable this if NS code can be remapped in
+# place (e.g. by a JIT or a loader that reuses virtual addresses).
+CFG_SECLOAK_EMU_ITLB ?= y
+
+# SeCloak: Drop the CSU protection of a CSL while every emulated region in its
+# device ranges allows all accesses, restoring it when a restrictive region is
+# added. No driver relies on this yet, so it is off by default.
+CFG_SECLOAK_CSU_DEMOTE ?= n
+
+# SeCloak: Cycles to spend re-reading a register in the secure world when NS
+# code is detected spinning on it through trapped reads (0 disables).
+CFG_SECLOAK_EMU_POLL_BUDGET ?= 20000
+
+# SeCloak: Number of traps to a disabled (deny-all) region within
+# CFG_SECLOAK_EMU_STORM_WINDOW cycles after which the rest of the window is
+# counted and logged as a trap storm (0 disables). Detection sends every trap
+# to a disabled region through the slow path, bypassing the deny-all fast path.
+CFG_SECLOAK_EMU_STORM_TRAPS ?= 0
+CFG_SECLOAK_EMU_STORM_WINDOW ?= 100000000
+
+# SeCloak: Raise an external abort in the NS world for each trap during a
+# storm, instead of returning 0 again. This crashes a misbehaving NS driver.
+CFG_SECLOAK_EMU_STORM_ABORT ?= n